@@ -0,0 +1,437 @@
+// Applications described by XDG .desktop files, so that they can be launched by their names.
+// Parsed entries are kept in an index file, and a .desktop file is only parsed again once its modification time changes.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define POOL_SIZE 64 * 1024
+
+#define APPS_FILE  "~/.cache/pistachio/applications"
+
+#define APPS_MAGIC    0x61707370 // "psap"
+#define APPS_VERSION  1
+#define MAX_APPS_SIZE  16 * 1024 * 1024
+#define MAX_DESKTOP_FILE  256 * 1024
+
+#define ALIGN8(n) (((n) + 7) & ~7)
+
+// The user's own applications come first, so that they take the place of system ones with the same file name
+static char *app_dirs[] = {
+	"~/.local/share/applications",
+	"/usr/share/applications"
+};
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 n_records;
+	u32 size;
+} Apps_Header;
+
+// Each record is followed by the path, name and command, each null-terminated
+typedef struct {
+	u32 size;
+	u32 path_len;
+	u32 name_len;
+	u32 exec_len;
+	u64 mtime_sec;
+	u64 mtime_nsec;
+	u8 terminal;
+	u8 no_display;
+	u8 pad[6];
+} Apps_Record;
+
+static Arena arena = {0};
+
+static Application *apps = NULL;
+static int n_apps = 0;
+
+static pthread_mutex_t apps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t apps_ready = PTHREAD_COND_INITIALIZER;
+static bool started = false;
+static bool loaded = false;
+
+static char *copy_string(char *str, int len) {
+	char *s = allocate(&arena, len + 1);
+	memcpy(s, str, len);
+	s[len] = 0;
+	return s;
+}
+
+// Removes the field codes (%f, %u, etc.) from an Exec line, since files are never passed to the application
+static char *strip_field_codes(char *exec, int len) {
+	char *out = allocate(&arena, len + 1);
+	int n = 0;
+
+	for (int i = 0; i < len; i++) {
+		if (exec[i] != '%') {
+			out[n++] = exec[i];
+			continue;
+		}
+
+		if (i + 1 < len && exec[i+1] == '%')
+			out[n++] = '%';
+		i++;
+	}
+
+	while (n > 0 && out[n-1] == ' ')
+		n--;
+
+	out[n] = 0;
+	return out;
+}
+
+static bool parse_desktop_file(char *path, Application *app) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	char *buf = malloc(MAX_DESKTOP_FILE + 1);
+	int size = read(fd, buf, MAX_DESKTOP_FILE);
+	close(fd);
+
+	if (size <= 0) {
+		free(buf);
+		return false;
+	}
+	buf[size] = 0;
+
+	bool in_entry = false;
+	bool is_app = false;
+	char *line = buf;
+
+	while (line) {
+		char *end = strchr(line, '\n');
+		if (end)
+			*end = 0;
+
+		int len = strlen(line);
+		if (len > 0 && line[len-1] == '\r')
+			line[--len] = 0;
+
+		if (line[0] == '[')
+			in_entry = !strcmp(line, "[Desktop Entry]");
+		else if (in_entry) {
+			char *value = strchr(line, '=');
+			if (value) {
+				int key_len = value - line;
+				while (key_len > 0 && line[key_len-1] == ' ')
+					key_len--;
+
+				value++;
+				while (*value == ' ')
+					value++;
+
+				int value_len = strlen(value);
+
+				// Localised keys such as Name[fr] are skipped, since their key length doesn't match
+				if (key_len == 4 && !memcmp(line, "Name", 4))
+					app->name = copy_string(value, value_len);
+				else if (key_len == 4 && !memcmp(line, "Exec", 4))
+					app->exec = strip_field_codes(value, value_len);
+				else if (key_len == 4 && !memcmp(line, "Type", 4))
+					is_app = !strcmp(value, "Application");
+				else if (key_len == 8 && !memcmp(line, "Terminal", 8))
+					app->terminal = !strcmp(value, "true");
+				else if ((key_len == 9 && !memcmp(line, "NoDisplay", 9)) || (key_len == 6 && !memcmp(line, "Hidden", 6)))
+					app->no_display |= !strcmp(value, "true");
+			}
+		}
+
+		line = end ? end + 1 : NULL;
+	}
+
+	free(buf);
+
+	// Entries that can't be launched are kept as hidden, so that the file isn't parsed again until it changes
+	if (!is_app || !app->name || !app->exec || !app->exec[0])
+		app->no_display = true;
+
+	if (!app->name)
+		app->name = "";
+	if (!app->exec)
+		app->exec = "";
+
+	return true;
+}
+
+static Apps_Record *next_record(char *index, int size, Apps_Record *rec) {
+	char *p = rec ? (char*)rec + rec->size : &index[sizeof(Apps_Header)];
+	if (p + sizeof(Apps_Record) > &index[size])
+		return NULL;
+
+	rec = (Apps_Record*)p;
+	int strings = rec->path_len + rec->name_len + rec->exec_len + 3;
+	if (rec->size != ALIGN8(sizeof(Apps_Record) + strings) || rec->size > &index[size] - p)
+		return NULL;
+
+	char *path = (char*)&rec[1];
+	char *name = &path[rec->path_len + 1];
+	char *exec = &name[rec->name_len + 1];
+	if (path[rec->path_len] || name[rec->name_len] || exec[rec->exec_len])
+		return NULL;
+
+	return rec;
+}
+
+static char *read_index(char *index_path, int *size) {
+	FILE *f = fopen(index_path, "rb");
+	if (!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char *index = NULL;
+	if (*size >= sizeof(Apps_Header) && *size <= MAX_APPS_SIZE) {
+		index = malloc(*size);
+		if (fread(index, 1, *size, f) != *size) {
+			free(index);
+			index = NULL;
+		}
+	}
+
+	fclose(f);
+
+	Apps_Header *header = (Apps_Header*)index;
+	if (index && (header->magic != APPS_MAGIC || header->version != APPS_VERSION || header->size != *size)) {
+		free(index);
+		index = NULL;
+	}
+
+	return index;
+}
+
+static Apps_Record *find_record(char *index, int size, char *path) {
+	int path_len = strlen(path);
+	Apps_Record *rec = NULL;
+
+	while (index && (rec = next_record(index, size, rec))) {
+		if (rec->path_len == path_len && !memcmp(&rec[1], path, path_len))
+			return rec;
+	}
+
+	return NULL;
+}
+
+static void write_index(char *index_path) {
+	int size = sizeof(Apps_Header);
+	for (int i = 0; i < n_apps; i++)
+		size += ALIGN8(sizeof(Apps_Record) + strlen(apps[i].path) + strlen(apps[i].name) + strlen(apps[i].exec) + 3);
+
+	char *buf = calloc(1, size);
+	if (!buf)
+		return;
+
+	*(Apps_Header*)buf = (Apps_Header) {
+		.magic = APPS_MAGIC,
+		.version = APPS_VERSION,
+		.n_records = n_apps,
+		.size = size
+	};
+
+	char *p = &buf[sizeof(Apps_Header)];
+	for (int i = 0; i < n_apps; i++) {
+		Application *app = &apps[i];
+		Apps_Record *rec = (Apps_Record*)p;
+		*rec = (Apps_Record) {
+			.path_len = strlen(app->path),
+			.name_len = strlen(app->name),
+			.exec_len = strlen(app->exec),
+			.mtime_sec = app->mtime.tv_sec,
+			.mtime_nsec = app->mtime.tv_nsec,
+			.terminal = app->terminal,
+			.no_display = app->no_display
+		};
+		rec->size = ALIGN8(sizeof(Apps_Record) + rec->path_len + rec->name_len + rec->exec_len + 3);
+
+		char *str = (char*)&rec[1];
+		memcpy(str, app->path, rec->path_len + 1);
+		str += rec->path_len + 1;
+		memcpy(str, app->name, rec->name_len + 1);
+		str += rec->name_len + 1;
+		memcpy(str, app->exec, rec->exec_len + 1);
+
+		p += rec->size;
+	}
+
+	int path_len = strlen(index_path);
+	char temp_path[path_len + 5];
+	memcpy(temp_path, index_path, path_len);
+	strcpy(&temp_path[path_len], ".tmp");
+
+	create_parent_directories(index_path);
+
+	FILE *f = fopen(temp_path, "wb");
+	if (f) {
+		bool ok = fwrite(buf, 1, size, f) == size;
+		ok = fclose(f) == 0 && ok;
+
+		if (ok)
+			rename(temp_path, index_path);
+		else
+			unlink(temp_path);
+	}
+
+	free(buf);
+}
+
+static bool is_duplicate(char *file_name) {
+	for (int i = 0; i < n_apps; i++) {
+		char *other = strrchr(apps[i].path, '/');
+		if (other && !strcmp(&other[1], file_name))
+			return true;
+	}
+	return false;
+}
+
+static void load_applications(void *unused) {
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
+
+	char *index_path = get_desugared_path(APPS_FILE, strlen(APPS_FILE));
+
+	int index_size = 0;
+	char *index = read_index(index_path, &index_size);
+	int n_old = index ? ((Apps_Header*)index)->n_records : 0;
+
+	int cap = 0;
+	bool changed = false;
+
+	for (int d = 0; d < sizeof(app_dirs) / sizeof(char*); d++) {
+		// The directory is read through the listing cache, so an unchanged directory costs nothing to list
+		Listing list;
+		if (!list_directory(app_dirs[d], -1, &list))
+			continue;
+
+		int dir_len = strlen(list.path);
+
+		// The listing may be evicted while the files are being parsed, so the paths are taken from it first
+		char **paths = malloc((list.n_entries + 1) * sizeof(char*));
+		int n_paths = 0;
+
+		for (int i = 0; i < list.n_entries; i++) {
+			char *file_name = ENTRY_NAME(&list, i);
+			int len = list.lens[i];
+			if (len <= 8 || strcmp(&file_name[len - 8], ".desktop") || list.types[i] == DT_DIR)
+				continue;
+
+			if (is_duplicate(file_name))
+				continue;
+
+			char *path = allocate(&arena, dir_len + len + 2);
+			memcpy(path, list.path, dir_len);
+			path[dir_len] = '/';
+			memcpy(&path[dir_len + 1], file_name, len + 1);
+			paths[n_paths++] = path;
+		}
+
+		for (int i = 0; i < n_paths; i++) {
+			char *path = paths[i];
+
+			struct stat s;
+			if (stat(path, &s) != 0)
+				continue;
+
+			if (n_apps >= cap) {
+				cap = cap ? cap * 2 : 256;
+				apps = realloc(apps, cap * sizeof(Application));
+			}
+
+			Application *app = &apps[n_apps];
+			*app = (Application) {
+				.path = path,
+				.mtime = s.st_mtim
+			};
+
+			Apps_Record *rec = find_record(index, index_size, path);
+			if (rec && rec->mtime_sec == s.st_mtim.tv_sec && rec->mtime_nsec == s.st_mtim.tv_nsec) {
+				char *name = (char*)&rec[1] + rec->path_len + 1;
+				char *exec = name + rec->name_len + 1;
+
+				app->name = copy_string(name, rec->name_len);
+				app->exec = copy_string(exec, rec->exec_len);
+				app->terminal = rec->terminal;
+				app->no_display = rec->no_display;
+			}
+			else {
+				if (!parse_desktop_file(path, app))
+					continue;
+
+				changed = true;
+			}
+
+			n_apps++;
+		}
+
+		free(paths);
+	}
+
+	// Files that were removed also mean the index needs to be written again
+	if (changed || n_apps != n_old)
+		write_index(index_path);
+
+	free(index);
+
+	pthread_mutex_lock(&apps_lock);
+	loaded = true;
+	pthread_cond_broadcast(&apps_ready);
+	pthread_mutex_unlock(&apps_lock);
+}
+
+static bool start_loading() {
+	pthread_mutex_lock(&apps_lock);
+	bool was_started = started;
+	started = true;
+	pthread_mutex_unlock(&apps_lock);
+
+	return !was_started;
+}
+
+// Loads the application index on the worker pool, so that it's ready by the time it's needed
+void scan_applications() {
+	if (start_loading())
+		submit_job(load_applications, NULL);
+}
+
+// Gives every application that was found, once they've all been loaded
+Application *get_applications(int *n) {
+	if (start_loading())
+		load_applications(NULL);
+
+	pthread_mutex_lock(&apps_lock);
+	while (!loaded)
+		pthread_cond_wait(&apps_ready, &apps_lock);
+	pthread_mutex_unlock(&apps_lock);
+
+	*n = n_apps;
+	return apps;
+}
+
+// Gives the applications if they've all been loaded, or NULL if they're still loading, without waiting for them
+Application *get_loaded_applications(int *n) {
+	scan_applications();
+
+	pthread_mutex_lock(&apps_lock);
+	bool ready = loaded;
+	pthread_mutex_unlock(&apps_lock);
+
+	*n = ready ? n_apps : 0;
+	return ready ? apps : NULL;
+}
+
+Application *find_application(char *name) {
+	int n;
+	Application *list = get_applications(&n);
+
+	for (int i = 0; i < n; i++) {
+		if (!list[i].no_display && !strcmp(list[i].name, name))
+			return &list[i];
+	}
+
+	return NULL;
+}
@@ -1,82 +1,150 @@
-// A non-thread-safe expandable table of memory pools
+// An expandable table of memory pools.
+// Each arena must only be used by one thread at a time, though different threads may use their own arenas at once.
+// The pools of an arena are chained together, so that one arena can be freed without touching any other.
+
+#include <pthread.h>
 
 #include "pistachio.h"
 
 #define POOLS_PER_STAND 16
 
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Sits at the start of every pool, in front of the memory that's handed out
+typedef struct {
+	char *prev;
+	int slot;
+	int size;
+} Pool_Header;
+
 char **pools = NULL;
 int n_pools = 0;
 int table_len = 0;
 
-void find_next_pool(Arena *a) {
-	while (a->pool < table_len && pools[a->pool])
-		a->pool++;
+// No slot below this one is free
+static int first_free = 0;
+
+// Returns the usable part of a new pool, which is linked into the arena's chain.
+// The pool table must be locked before calling this.
+static char *add_pool(Arena *a, int *slot, int size) {
+	// Slots of freed pools are reused
+	int pool = first_free;
+	while (pool < table_len && pools[pool])
+		pool++;
 
-	if (a->pool >= table_len) {
+	first_free = pool + 1;
+
+	if (pool >= table_len) {
 		pools = realloc(pools, (table_len + POOLS_PER_STAND) * sizeof(char*));
 		memset(&pools[table_len], 0, POOLS_PER_STAND * sizeof(char*));
 		table_len += POOLS_PER_STAND;
 	}
 
-	if (a->pool >= n_pools)
-		n_pools = a->pool + 1;
+	if (pool >= n_pools)
+		n_pools = pool + 1;
+
+	pools[pool] = malloc(sizeof(Pool_Header) + size);
+	*slot = pool;
+
+	*(Pool_Header*)pools[pool] = (Pool_Header) {
+		.prev = a->chain,
+		.slot = pool,
+		.size = size
+	};
+	a->chain = pools[pool];
+	a->size += sizeof(Pool_Header) + size;
+
+	return &pools[pool][sizeof(Pool_Header)];
 }
 
-void make_arena(int pool_size, Arena *a) {
-	if (!pools) {
-		pools = calloc(POOLS_PER_STAND, sizeof(char*));
-		table_len = POOLS_PER_STAND;
-	}
+void find_next_pool(Arena *a) {
+	pthread_mutex_lock(&pool_lock);
+	a->base = add_pool(a, &a->pool, a->pool_size);
+	a->idx = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
 
+void make_arena(int pool_size, Arena *a) {
 	*a = (Arena) {
 		.pool_size = pool_size,
 		.pool = 0,
 		.idx = 0,
-		.allow_overflow = true,
+		.chain = NULL,
+		.size = 0,
 		.initialized = true
 	};
 
 	find_next_pool(a);
-	pools[a->pool] = malloc(a->pool_size);
 }
 
 void *allocate(Arena *a, int size) {
 	if (a->idx + size > a->pool_size) {
-		if (!a->allow_overflow)
-			return NULL;
-
-		a->idx = 0;
-		find_next_pool(a);
-
 		// if the allocation request is too large for a pool, make it its own pool
 		if (size > a->pool_size) {
-			pools[a->pool] = malloc(size);
-			void *ptr = (void*)pools[a->pool];
+			pthread_mutex_lock(&pool_lock);
+			int slot;
+			void *ptr = (void*)add_pool(a, &slot, size);
+			pthread_mutex_unlock(&pool_lock);
 
-			find_next_pool(a);
 			return ptr;
 		}
 
-		if (!pools[a->pool])
-			pools[a->pool] = malloc(a->pool_size);
+		find_next_pool(a);
 	}
 
-	void *ptr = (void*)&pools[a->pool][a->idx];
+	void *ptr = (void*)&a->base[a->idx];
 	a->idx += size;
 	return ptr;
 }
 
+// Makes sure the next 'size' bytes of the arena's current pool are free, without allocating them.
+// The space can be used as scratch until the next allocation from the arena.
+void *reserve(Arena *a, int size) {
+	if (size > a->pool_size)
+		return NULL;
+
+	if (a->idx + size > a->pool_size)
+		find_next_pool(a);
+
+	return (void*)&a->base[a->idx];
+}
+
+// Frees every pool that belongs to the arena, leaving it uninitialized
+void free_arena(Arena *a) {
+	pthread_mutex_lock(&pool_lock);
+
+	char *pool = a->chain;
+	while (pool) {
+		Pool_Header *header = (Pool_Header*)pool;
+		char *prev = header->prev;
+
+		pools[header->slot] = NULL;
+		if (header->slot < first_free)
+			first_free = header->slot;
+		free(pool);
+
+		pool = prev;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	memset(a, 0, sizeof(Arena));
+}
+
 void destroy_all_arenas() {
-	if (!pools)
-		return;
+	pthread_mutex_lock(&pool_lock);
+
+	if (pools) {
+		for (int i = 0; i < table_len; i++) {
+			if (pools[i])
+				free(pools[i]);
+		}
 
-	for (int i = 0; i < table_len; i++) {
-		if (pools[i])
-			free(pools[i]);
+		free(pools);
+		pools = NULL;
 	}
 
-	free(pools);
-	pools = NULL;
+	pthread_mutex_unlock(&pool_lock);
 }
 
 void defer_arena_destruction() {
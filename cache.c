@@ -0,0 +1,311 @@
+// An on-disk copy of every directory listing, mapped into memory at startup so that
+//  unchanged directories can be used without reading or sorting them again.
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define CACHE_FILE  "~/.cache/pistachio/listings"
+
+#define CACHE_MAGIC     0x68637370 // "psch"
+#define CACHE_VERSION   4
+#define MAX_CACHE_SIZE  64 * 1024 * 1024
+
+#define ALIGN8(n) (((n) + 7) & ~7)
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 n_records;
+	u32 size;
+} Cache_Header;
+
+// Each record is followed by the directory path, the index, the name-sorted index, the index sorted by folded name,
+//  the name offsets, the name lengths, the entry types, the names themselves and then the folded names,
+//  so a listing can use the mapping as it is.
+typedef struct {
+	u32 size;
+	u32 path_len;
+	u32 n_entries;
+	u32 names_size;
+	u64 dev;
+	u64 ino;
+	u64 mtime_sec;
+	u64 mtime_nsec;
+} Cache_Record;
+
+static char *cache = NULL;
+static int cache_size = 0;
+
+static char *cache_path = NULL;
+
+void open_listing_cache() {
+	cache_path = get_desugared_path(CACHE_FILE, strlen(CACHE_FILE));
+
+	int fd = open(cache_path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat s;
+	if (fstat(fd, &s) != 0 || s.st_size < sizeof(Cache_Header) || s.st_size > MAX_CACHE_SIZE) {
+		close(fd);
+		return;
+	}
+
+	char *map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return;
+
+	Cache_Header *header = (Cache_Header*)map;
+	if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->size != s.st_size) {
+		munmap(map, s.st_size);
+		return;
+	}
+
+	cache = map;
+	cache_size = s.st_size;
+}
+
+static int record_size(int path_len, int n_entries, int names_size) {
+	int columns = n_entries * (3 * sizeof(int) + sizeof(u32) + sizeof(u16) + sizeof(u8));
+	return ALIGN8(sizeof(Cache_Record) + ALIGN8(path_len + 1) + columns + 2 * names_size);
+}
+
+static Cache_Record *next_record(Cache_Record *rec) {
+	char *end = &cache[cache_size];
+	char *p = rec ? (char*)rec + rec->size : &cache[sizeof(Cache_Header)];
+
+	if (p + sizeof(Cache_Record) > end)
+		return NULL;
+
+	rec = (Cache_Record*)p;
+	if (rec->size < sizeof(Cache_Record) || rec->size > end - p)
+		return NULL;
+
+	if (rec->size != record_size(rec->path_len, rec->n_entries, rec->names_size))
+		return NULL;
+
+	return rec;
+}
+
+static bool is_valid_record(Cache_Record *rec, Listing *l) {
+	if (rec->names_size == 0)
+		return false;
+
+	for (int i = 0; i < rec->n_entries; i++) {
+		if (l->index[i] < 0 || l->index[i] >= rec->n_entries || l->sorted[i] < 0 || l->sorted[i] >= rec->n_entries)
+			return false;
+		if (l->folded_sorted[i] < 0 || l->folded_sorted[i] >= rec->n_entries)
+			return false;
+
+		u32 end = l->offsets[i] + l->lens[i];
+		if (l->offsets[i] >= rec->names_size || end >= rec->names_size || l->names[end] != 0 || l->folded[end] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool find_cached_listing(char *path, struct stat *s, Listing *l) {
+	if (!cache)
+		return false;
+
+	int path_len = strlen(path);
+	Cache_Record *rec = NULL;
+
+	while ((rec = next_record(rec))) {
+		char *rec_path = (char*)&rec[1];
+		if (rec->path_len != path_len || memcmp(rec_path, path, path_len))
+			continue;
+
+		if (rec->dev != s->st_dev || rec->ino != s->st_ino ||
+			rec->mtime_sec != s->st_mtim.tv_sec || rec->mtime_nsec != s->st_mtim.tv_nsec
+		)
+			return false;
+
+		int n = rec->n_entries;
+		Listing cached = {
+			.index = (int*)&rec_path[ALIGN8(path_len + 1)]
+		};
+		cached.sorted = &cached.index[n];
+		cached.folded_sorted = &cached.sorted[n];
+		cached.offsets = (u32*)&cached.folded_sorted[n];
+		cached.lens = (u16*)&cached.offsets[n];
+		cached.types = (u8*)&cached.lens[n];
+		cached.names = (char*)&cached.types[n];
+		cached.folded = &cached.names[rec->names_size];
+
+		if (n > 0 && !is_valid_record(rec, &cached))
+			return false;
+
+		l->index = cached.index;
+		l->sorted = cached.sorted;
+		l->folded_sorted = cached.folded_sorted;
+		l->offsets = cached.offsets;
+		l->lens = cached.lens;
+		l->types = cached.types;
+		l->names = n > 0 ? cached.names : NULL;
+		l->folded = n > 0 ? cached.folded : NULL;
+		l->n_entries = n;
+		l->from_cache = true;
+		return true;
+	}
+
+	return false;
+}
+
+static int names_size(Listing *l) {
+	int size = 0;
+	for (int i = 0; i < l->n_entries; i++)
+		size += l->lens[i] + 1;
+
+	return size;
+}
+
+static char *write_record(char *p, char *path, struct stat *s, Listing *l, int names_sz) {
+	int path_len = strlen(path);
+
+	Cache_Record *rec = (Cache_Record*)p;
+	*rec = (Cache_Record) {
+		.size = record_size(path_len, l->n_entries, names_sz),
+		.path_len = path_len,
+		.n_entries = l->n_entries,
+		.names_size = names_sz,
+		.dev = s->st_dev,
+		.ino = s->st_ino,
+		.mtime_sec = s->st_mtim.tv_sec,
+		.mtime_nsec = s->st_mtim.tv_nsec
+	};
+
+	char *rec_path = (char*)&rec[1];
+	memset(rec_path, 0, ALIGN8(path_len + 1));
+	memcpy(rec_path, path, path_len);
+
+	int *index = (int*)&rec_path[ALIGN8(path_len + 1)];
+	memcpy(index, l->index, l->n_entries * sizeof(int));
+
+	int *sorted = &index[l->n_entries];
+	memcpy(sorted, l->sorted, l->n_entries * sizeof(int));
+
+	int *folded_sorted = &sorted[l->n_entries];
+	memcpy(folded_sorted, l->folded_sorted, l->n_entries * sizeof(int));
+
+	// The names are packed again in entry order, since a listing's names don't have to be in any particular order.
+	// The folded names follow at the same offsets.
+	u32 *offsets = (u32*)&folded_sorted[l->n_entries];
+	u16 *lens = (u16*)&offsets[l->n_entries];
+	memcpy(lens, l->lens, l->n_entries * sizeof(u16));
+
+	u8 *types = (u8*)&lens[l->n_entries];
+	memcpy(types, l->types, l->n_entries * sizeof(u8));
+
+	char *names = (char*)&types[l->n_entries];
+	char *folded = &names[names_sz];
+	u32 pos = 0;
+	for (int i = 0; i < l->n_entries; i++) {
+		offsets[i] = pos;
+		memcpy(&names[pos], ENTRY_NAME(l, i), l->lens[i] + 1);
+		memcpy(&folded[pos], FOLDED_NAME(l, i), l->lens[i] + 1);
+		pos += l->lens[i] + 1;
+	}
+	names = &folded[pos];
+
+	char *end = p + rec->size;
+	memset(names, 0, end - names);
+	return end;
+}
+
+static bool is_listed(Listing *list, char *path, int path_len) {
+	for (Listing *l = list; l; l = l->next) {
+		if (l->path && !strncmp(l->path, path, path_len) && l->path[path_len] == 0)
+			return true;
+	}
+	return false;
+}
+
+void write_listing_cache(Listing *list) {
+	if (!cache_path)
+		return;
+
+	int size = sizeof(Cache_Header);
+	int n_records = 0;
+
+	for (Listing *l = list; l; l = l->next) {
+		if (l->path && !l->pending) {
+			size += record_size(strlen(l->path), l->n_entries, names_size(l));
+			n_records++;
+		}
+	}
+
+	if (size > MAX_CACHE_SIZE)
+		return;
+
+	// Keep the records of directories that weren't visited this time, as long as there's room
+	Cache_Record *rec = NULL;
+	while (cache && (rec = next_record(rec))) {
+		if (size + rec->size > MAX_CACHE_SIZE)
+			break;
+		if (is_listed(list, (char*)&rec[1], rec->path_len))
+			continue;
+
+		size += rec->size;
+		n_records++;
+	}
+
+	char *buf = malloc(size);
+	if (!buf)
+		return;
+
+	*(Cache_Header*)buf = (Cache_Header) {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.n_records = n_records,
+		.size = size
+	};
+
+	char *p = &buf[sizeof(Cache_Header)];
+	for (Listing *l = list; l; l = l->next) {
+		if (!l->path || l->pending)
+			continue;
+
+		struct stat s = {
+			.st_dev = l->dev,
+			.st_ino = l->ino,
+			.st_mtim = l->mtime
+		};
+		p = write_record(p, l->path, &s, l, names_size(l));
+	}
+
+	rec = NULL;
+	while (cache && p < &buf[size] && (rec = next_record(rec))) {
+		if (is_listed(list, (char*)&rec[1], rec->path_len))
+			continue;
+
+		memcpy(p, rec, rec->size);
+		p += rec->size;
+	}
+
+	int path_len = strlen(cache_path);
+	char temp_path[path_len + 5];
+	memcpy(temp_path, cache_path, path_len);
+	strcpy(&temp_path[path_len], ".tmp");
+
+	create_parent_directories(cache_path);
+
+	FILE *f = fopen(temp_path, "wb");
+	if (f) {
+		bool ok = fwrite(buf, 1, size, f) == size;
+		ok = fclose(f) == 0 && ok;
+
+		if (ok)
+			rename(temp_path, cache_path);
+		else
+			unlink(temp_path);
+	}
+
+	free(buf);
+}
@@ -0,0 +1,303 @@
+// A merged index of every program in $PATH, along with every application that has a .desktop file.
+// Programs in earlier directories shadow programs of the same name in later ones, as they would in a shell,
+//  and programs shadow applications.
+
+#include <errno.h>
+
+#include "pistachio.h"
+
+#define POOL_SIZE 256 * 1024
+
+typedef struct {
+	char *name;
+	u32 hash;
+	int len;
+	u8 type;
+	int dir;
+	int app;
+} Command;
+
+static Arena arena = {0};
+
+// Everything built from the listings lives here, and is thrown away whenever the index is built again
+static Arena index_arena = {0};
+
+static char **dirs = NULL;
+static char **dir_paths = NULL;
+static int n_dirs = 0;
+
+// The listing of each directory that the index was built from, which tells when one of them has been read again
+static u32 *dir_ids = NULL;
+
+static Command *commands = NULL;
+static int n_commands = 0;
+
+// Open-addressed hash table of indices into 'commands'
+static int *slots = NULL;
+static int n_slots = 0;
+
+static Listing command_listing = {0};
+static int generation = -1;
+
+// The applications are loaded in the background, and the index is built again once they're in
+static bool has_apps = false;
+
+static void split_path_variable() {
+	char *bin_path = getenv("PATH");
+	if (!bin_path)
+		return;
+
+	n_dirs = 1;
+	for (char *p = bin_path; *p; p++)
+		n_dirs += *p == ':';
+
+	dirs = allocate(&arena, n_dirs * sizeof(char*));
+	dir_paths = allocate(&arena, n_dirs * sizeof(char*));
+	dir_ids = allocate(&arena, n_dirs * sizeof(u32));
+	n_dirs = 0;
+
+	char *next = bin_path;
+	char *p = &bin_path[-1];
+	do {
+		p++;
+		if (*p != ':' && *p != 0)
+			continue;
+
+		int len = p - next;
+		if (len > 0) {
+			dirs[n_dirs] = allocate(&arena, len + 1);
+			memcpy(dirs[n_dirs], next, len);
+			dirs[n_dirs][len] = 0;
+			n_dirs++;
+		}
+
+		next = p + 1;
+	} while (*p);
+}
+
+static int compare_commands(const void *p1, const void *p2) {
+	Command *c1 = (Command*)p1;
+	Command *c2 = (Command*)p2;
+
+	int diff = strcmp(c1->name, c2->name);
+	if (diff)
+		return diff;
+
+	// Applications are given a directory after every real one
+	return c1->dir - c2->dir;
+}
+
+static void align_arena() {
+	if (index_arena.idx % sizeof(char*))
+		allocate(&index_arena, sizeof(char*) - (index_arena.idx % sizeof(char*)));
+}
+
+static char *copy_path(char *path) {
+	if (!path)
+		return NULL;
+
+	int len = strlen(path);
+	char *str = allocate(&index_arena, len + 1);
+	memcpy(str, path, len + 1);
+	return str;
+}
+
+static void build_index() {
+	if (!arena.initialized) {
+		make_arena(POOL_SIZE, &arena);
+		split_path_variable();
+	}
+
+	// Any listing that changes while the index is being built will cause it to be built again next time
+	generation = get_listings_generation();
+
+	// The listings can be evicted once they're no longer in use, so nothing in the index points into them
+	if (index_arena.initialized)
+		free_arena(&index_arena);
+	make_arena(POOL_SIZE, &index_arena);
+
+	Listing lists[n_dirs + 1];
+	int total = 0;
+
+	for (int i = 0; i < n_dirs; i++) {
+		// A directory on a hung mount is left out until it's been read, which changes the generation and rebuilds the index
+		list_directory_within(dirs[i], -1, &lists[i], IO_DEADLINE_MS);
+		dir_paths[i] = copy_path(lists[i].path);
+		dir_ids[i] = lists[i].id;
+		total += lists[i].n_entries;
+	}
+
+	int n_apps = 0;
+	Application *apps = get_loaded_applications(&n_apps);
+	has_apps = apps != NULL;
+
+	Command *all = malloc((total + n_apps + 1) * sizeof(Command));
+	int n_all = 0;
+
+	for (int i = 0; i < n_dirs; i++) {
+		for (int j = 0; j < lists[i].n_entries; j++) {
+			if (lists[i].types[j] == DT_DIR)
+				continue;
+
+			all[n_all++] = (Command) {
+				.name = ENTRY_NAME(&lists[i], j),
+				.len = lists[i].lens[j],
+				.type = lists[i].types[j],
+				.dir = i,
+				.app = -1
+			};
+		}
+	}
+
+	for (int i = 0; i < n_apps; i++) {
+		if (apps[i].no_display)
+			continue;
+
+		all[n_all++] = (Command) {
+			.name = apps[i].name,
+			.len = strlen(apps[i].name),
+			.type = DT_REG,
+			.dir = n_dirs,
+			.app = i
+		};
+	}
+
+	qsort(all, n_all, sizeof(Command), compare_commands);
+
+	align_arena();
+	commands = allocate(&index_arena, (n_all + 1) * sizeof(Command));
+	n_commands = 0;
+
+	// Sorting by name then by directory leaves the program that wins at the front of each run of duplicates
+	int names_size = 0;
+	for (int i = 0; i < n_all; i++) {
+		if (n_commands > 0 && !strcmp(all[i].name, commands[n_commands-1].name))
+			continue;
+
+		commands[n_commands] = all[i];
+		commands[n_commands].hash = hash_string(all[i].name, -1);
+		names_size += all[i].len + 1;
+		n_commands++;
+	}
+
+	free(all);
+
+	n_slots = 16;
+	while (n_slots < n_commands * 2)
+		n_slots *= 2;
+
+	// A rebuilt index can land at the same address with the same count, so it gets a new id for the filters to tell it apart
+	command_listing = (Listing) {
+		.index = allocate(&index_arena, (n_commands + 1) * sizeof(int)),
+		.offsets = allocate(&index_arena, (n_commands + 1) * sizeof(u32)),
+		.n_entries = n_commands,
+		.id = new_listing_id()
+	};
+	command_listing.sorted = command_listing.index;
+
+	slots = allocate(&index_arena, n_slots * sizeof(int));
+	memset(slots, 0xff, n_slots * sizeof(int));
+
+	command_listing.lens = allocate(&index_arena, (n_commands + 1) * sizeof(u16));
+	command_listing.types = allocate(&index_arena, n_commands + 1);
+	command_listing.names = allocate(&index_arena, names_size + 1);
+
+	// The names come from several listings, so they're packed together to make this one
+	int pos = 0;
+	for (int i = 0; i < n_commands; i++) {
+		memcpy(&command_listing.names[pos], commands[i].name, commands[i].len + 1);
+		commands[i].name = &command_listing.names[pos];
+
+		command_listing.offsets[i] = pos;
+		command_listing.lens[i] = commands[i].len;
+		command_listing.types[i] = commands[i].type;
+		command_listing.index[i] = i;
+		pos += commands[i].len + 1;
+
+		int s = commands[i].hash & (n_slots - 1);
+		while (slots[s] >= 0)
+			s = (s + 1) & (n_slots - 1);
+
+		slots[s] = i;
+	}
+
+	align_arena();
+	fold_entries(&command_listing, &index_arena);
+}
+
+// Listings are read again all the time, so the index is only built again when one of the PATH directories is among them
+static void update_index() {
+	int n_apps;
+	bool stale = !arena.initialized || (!has_apps && get_loaded_applications(&n_apps));
+
+	int now = get_listings_generation();
+	if (!stale && generation != now) {
+		generation = now;
+
+		// Every listing that's already been read is looked up without a lock, so this doesn't cost much
+		for (int i = 0; i < n_dirs && !stale; i++) {
+			Listing list;
+			list_directory_within(dirs[i], -1, &list, 0);
+			stale = list.id != dir_ids[i];
+		}
+	}
+
+	if (stale)
+		build_index();
+}
+
+static Command *find_command(char *name) {
+	update_index();
+	if (!n_commands)
+		return NULL;
+
+	u32 hash = hash_string(name, -1);
+	int s = hash & (n_slots - 1);
+
+	while (slots[s] >= 0) {
+		Command *cmd = &commands[slots[s]];
+		if (cmd->hash == hash && !strcmp(cmd->name, name))
+			return cmd;
+
+		s = (s + 1) & (n_slots - 1);
+	}
+
+	return NULL;
+}
+
+// Gives a listing of every program in $PATH, sorted by name
+void list_commands(Listing *info) {
+	update_index();
+	memcpy(info, &command_listing, sizeof(Listing));
+}
+
+bool find_program(char *name, char **error_str) {
+	Command *cmd = find_command(name);
+	if (!cmd || cmd->app >= 0 || !dir_paths[cmd->dir]) {
+		if (error_str) *error_str = "command not found: ";
+		return false;
+	}
+
+	if (error_str) *error_str = NULL;
+
+	char file[4096];
+	snprintf(file, sizeof(file), "%s/%s", dir_paths[cmd->dir], name);
+
+	struct stat s;
+	if (!stat_within(file, &s, IO_DEADLINE_MS)) {
+		if (error_str) *error_str = errno == ETIMEDOUT ? "not responding: " : "command not found: ";
+		return false;
+	}
+
+	if ((s.st_mode & S_IFMT) == S_IFDIR) {
+		if (error_str) *error_str = "not a regular file: ";
+		return false;
+	}
+
+	if ((s.st_mode & S_IXUSR) == 0) {
+		if (error_str) *error_str = "missing execute permission: ";
+		return false;
+	}
+
+	return true;
+}
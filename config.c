@@ -65,7 +65,9 @@ Settings config = {
 		0,
 		false,
 		NULL
-	}
+	},
+	.search_mode = SEARCH_PREFIX,
+	.listing_memory = DEFAULT_LISTING_MEMORY_MB
 };
 
 char *command_list[] = {
@@ -83,7 +85,9 @@ char *command_list[] = {
 	"default-command",
 	"program",
 	"command",
-	"nodaemon"
+	"nodaemon",
+	"search-mode",
+	"listing-memory"
 };
 
 char *allocate_string(char *src, int len) {
@@ -337,6 +341,21 @@ void parse_config_line(char *line, int len, bool *daemonize) {
 			parse_config_line(params, params_len, &d);
 			break;
 		}
+
+		case 15: // search-mode
+			if (params_len == 5 && !strncmp(params, "fuzzy", 5))
+				config.search_mode = SEARCH_FUZZY;
+			else if (params_len == 6 && !strncmp(params, "prefix", 6))
+				config.search_mode = SEARCH_PREFIX;
+			break;
+
+		case 16: // listing-memory
+		{
+			int mb = atoi(params);
+			if (mb > 0)
+				config.listing_memory = mb;
+			break;
+		}
 	}
 }
 
@@ -392,18 +411,8 @@ Settings *load_config() {
 	return &config;
 }
 
-void save_config(char *cfg_path) {
-	int len = strlen(cfg_path);
-	char *path = allocate(&arena, len + 1);
-	memset(path, 0, len + 1);
-
-	char *src = cfg_path, *dst = path;
-	for (int i = 0; i < len; i++) {
-		if (i > 0 && *src == '/')
-			mkdir(path, 0777);
-
-		*dst++ = *src++;
-	}
+void save_config(char *path) {
+	create_parent_directories(path);
 
 	FILE *f = fopen(path, "w");
 	if (!f) {
@@ -444,7 +453,9 @@ void save_config(char *cfg_path) {
 		"window-height %g%%\n"
 		"terminal-program %s\n"
 		"folder-program %s\n"
-		"default-program %s\n",
+		"default-program %s\n"
+		"search-mode %s\n"
+		"listing-memory %d\n",
 		config.font_path,
 		config.search_font.size,  &color_strs[0 * 9], config.search_font.oblique ? " oblique" : "",
 		config.results_font.size, &color_strs[1 * 9], config.results_font.oblique ? " oblique" : "",
@@ -456,7 +467,9 @@ void save_config(char *cfg_path) {
 		config.window_h * 100.0,
 		config.terminal_program.command,
 		config.folder_program.command,
-		config.default_program.command
+		config.default_program.command,
+		config.search_mode == SEARCH_FUZZY ? "fuzzy" : "prefix",
+		config.listing_memory
 	);
 
 	fclose(f);
@@ -1,178 +1,1416 @@
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stddef.h>
 #include <unistd.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "pistachio.h"
 
 #define POOL_SIZE 1024 * 1024
+#define DIRENT_BUFFER_SIZE 256 * 1024
+
+#define PREFETCH_COUNT   4
+#define PREFETCH_SCAN    64
+#define PREFETCH_BUDGET  1024 * 1024
+
+#define MAX_IDLE_ARENAS  8
+
+#define MAX_READERS  64
+
+#define FIRST_SNAPSHOT   4096
+#define SNAPSHOT_GROWTH  4
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
 
 Listing *listings = NULL;
 Listing **list_head = NULL;
 
-static Arena arena = {0};
+static pthread_mutex_t listings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t listing_ready = PTHREAD_COND_INITIALIZER;
+
+// Open-addressed hash table of every listing in the chain, keyed by its normalized path.
+// Listings are looked up without the lock, so a listing is never changed once it's in the table, only replaced by a new one,
+//  and the table itself is replaced rather than grown.
+typedef struct {
+	int n_slots;
+	Listing *slots[];
+} Listing_Table;
+
+static Listing_Table *table = NULL;
+static int n_used = 0;
+
+// Each thread that reads directories gets its own arena
+static __thread Arena arena = {0};
+
+static int watch_fd = -1;
+
+// Signalled when a listing that someone stopped waiting for is finally ready
+static int notify_fd = -1;
+
+// Arenas left behind by reader threads that have finished, for the next reader to carry on filling
+static Arena idle_arenas[MAX_IDLE_ARENAS];
+static int n_idle_arenas = 0;
+
+// Counts the number of times a listing has been changed or removed
+static int generation = 0;
+
+// Gives every listing that's read a different id, since a new listing can end up at the same address as an old one
+static u32 next_id = 0;
+
+// Listings are evicted, least recently used first, once their arenas hold more than this many bytes
+static u64 memory_budget = (u64)DEFAULT_LISTING_MEMORY_MB * 1024 * 1024;
+static u64 memory_used = 0;
+
+// The number of entries in listings that were read by prefetching and are still in the table.
+// It's capped so that speculation can't take up too much memory, and goes down again as those listings are evicted.
+static int n_prefetched = 0;
+
+// Counts every use of a listing, so that the least recently used can be found
+static u64 use_clock = 0;
+
+// The clock at the last two trims. Anything used since the earlier one is likely to be wanted again, so it isn't evicted.
+static u64 last_trim = 0;
+static u64 prev_trim = 0;
+
+// Memory that's no longer part of any listing or the table, but might still be in use.
+// It's stamped with the epoch it was retired in, and freed once no reader started in that epoch or before,
+//  and not before the trim after next, so that the window has a whole frame to let go of it.
+typedef struct retired_struct {
+	Arena arena;
+	Listing *listing;
+	Listing_Table *table;
+	u64 epoch;
+	struct retired_struct *next;
+} Retired;
+
+static Retired *retired = NULL;
+
+// Moved on at every trim
+static u64 epoch = 1;
+
+// The epoch each thread that's been given listings started reading in, or 0 once it's let go of them all.
+// Each is on a cache line of its own, since every thread writes its own whenever it starts or stops.
+typedef struct {
+	u64 epoch;
+	char pad[64 - sizeof(u64)];
+} Reader;
+
+static Reader readers[MAX_READERS];
+static int n_readers = 0;
+static __thread int reader_id = -1;
 
 void init_directory_arena() {
 	make_arena(POOL_SIZE, &arena);
 	list_head = &listings;
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	get_home_directory();
+	open_listing_cache();
+}
+
+static void align_arena() {
+	if (arena.idx % sizeof(char*))
+		allocate(&arena, sizeof(char*) - (arena.idx % sizeof(char*)));
 }
 
-Listing *current = NULL;
+// Each entry is sorted on a key holding whether it's a directory and the first bytes of its name,
+//  so most comparisons never have to look at the names themselves
+typedef struct {
+	u64 key;
+	u32 idx;
+} Sort_Item;
 
-static int compare_entries(const void *p1, const void *p2) {
-	Listing *l = current;
-	int idx1 = *(int*)p1;
-	int idx2 = *(int*)p2;
+typedef struct {
+	char *name;
+	u32 idx;
+} Sort_Tie;
 
-	int mode1 = l->stats[idx1].st_mode & S_IFDIR;
-	int mode2 = l->stats[idx2].st_mode & S_IFDIR;
+#define KEY_FILE_FLAG  (1ull << 63)
+#define KEY_NAME_BYTES 7
 
-	if (mode1 && !mode2)
-		return -1;
-	if (!mode1 && mode2)
-		return 1;
+static u64 make_sort_key(char *name, bool is_file) {
+	u64 key = is_file ? KEY_FILE_FLAG : 0;
 
-	return strcmp(l->table[idx1], l->table[idx2]);
+	// The bytes are packed most significant first, so comparing keys compares the names like strcmp does
+	for (int i = 0; i < KEY_NAME_BYTES && name[i]; i++)
+		key |= (u64)(u8)name[i] << (8 * (KEY_NAME_BYTES - 1 - i));
+
+	return key;
 }
 
-void sort_entries(Listing *l, char *path) {
-	if (arena.idx % sizeof(char*))
-		allocate(&arena, sizeof(char*) - (arena.idx % sizeof(char*)));
+// Sorts the items by key a byte at a time, least significant first. Bytes that are the same in every key are skipped.
+static void radix_sort(Sort_Item *items, Sort_Item *temp, int n) {
+	u32 counts[8][256] = {0};
+	for (int i = 0; i < n; i++) {
+		u64 key = items[i].key;
+		for (int b = 0; b < 8; b++)
+			counts[b][(key >> (8 * b)) & 0xff]++;
+	}
 
-	l->index = (int*)allocate(&arena, l->n_entries * sizeof(int));
-	l->index[0] = 0;
+	Sort_Item *src = items;
+	Sort_Item *dst = temp;
 
-	l->table = (char**)allocate(&arena, l->n_entries * sizeof(char*));
-	l->table[0] = l->first;
+	for (int b = 0; b < 8; b++) {
+		int shift = 8 * b;
+		if (counts[b][(src[0].key >> shift) & 0xff] == n)
+			continue;
 
-	int path_len = strlen(path);
-	strcpy(&path[path_len++], "/");
+		u32 offsets[256];
+		u32 total = 0;
+		for (int c = 0; c < 256; c++) {
+			offsets[c] = total;
+			total += counts[b][c];
+		}
+
+		for (int i = 0; i < n; i++)
+			dst[offsets[(src[i].key >> shift) & 0xff]++] = src[i];
 
-	l->stats = (struct stat*)allocate(&arena, l->n_entries * sizeof(struct stat));
-	strcpy(&path[path_len], l->table[0]);
-	stat(path, &l->stats[0]);
+		Sort_Item *swap = src;
+		src = dst;
+		dst = swap;
+	}
 
-	for (int i = 1; i < l->n_entries; i++) {
-		l->index[i] = i;
+	if (src != items)
+		memcpy(items, src, n * sizeof(Sort_Item));
+}
 
-		int sz = strlen(l->table[i-1]) + 1;
-		l->table[i] = &l->table[i-1][sz];
+static int compare_ties(const void *p1, const void *p2) {
+	return strcmp(((Sort_Tie*)p1)->name, ((Sort_Tie*)p2)->name);
+}
 
-		strcpy(&path[path_len], l->table[i]);
-		if (lstat(path, &l->stats[i]) != 0)
-			memset(&l->stats[i], 0, sizeof(struct stat));
+// Entries whose keys are equal share their first bytes, so only those runs need their full names compared
+static void sort_ties(Listing *l, char *names, Sort_Item *items, int n) {
+	Sort_Tie *ties = NULL;
+	int cap = 0;
+
+	for (int start = 0; start < n; ) {
+		int end = start + 1;
+		while (end < n && items[end].key == items[start].key)
+			end++;
+
+		int run = end - start;
+		if (run > 1) {
+			if (run > cap) {
+				cap = run;
+				ties = realloc(ties, cap * sizeof(Sort_Tie));
+			}
+
+			// A key whose last byte is set means every name in the run is at least that long, so their first bytes can be skipped
+			int skip = (items[start].key & 0xff) ? KEY_NAME_BYTES : 0;
+			for (int i = 0; i < run; i++)
+				ties[i] = (Sort_Tie) { &names[l->offsets[items[start + i].idx] + skip], items[start + i].idx };
+
+			qsort(ties, run, sizeof(Sort_Tie), compare_ties);
+
+			for (int i = 0; i < run; i++)
+				items[start + i].idx = ties[i].idx;
+		}
+
+		start = end;
 	}
 
-	current = l;
-	qsort(l->index, l->n_entries, sizeof(int), compare_entries);
+	free(ties);
 }
 
-void get_directory_entries(DIR *d, Listing *l) {
-	// This codebase depends on directory entries being laid out contiguously in memory,
-	//  so we temporarily disable the ability for this arena to spill over to another pool.
-	arena.allow_overflow = false;
+// Lowercases the ASCII letters in 'src', a vector at a time
+static void fold_case(char *dst, char *src, int len) {
+	int i = 0;
 
-	char *prev = NULL;
-	struct dirent *ent;
-	while ((ent = readdir(d))) {
-		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
-			continue;
+#if defined(__AVX2__)
+	__m256i below_a32 = _mm256_set1_epi8('A' - 1);
+	__m256i above_z32 = _mm256_set1_epi8('Z' + 1);
+	__m256i case_bit32 = _mm256_set1_epi8(0x20);
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((__m256i*)&src[i]);
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, below_a32), _mm256_cmpgt_epi8(above_z32, chunk));
+		_mm256_storeu_si256((__m256i*)&dst[i], _mm256_or_si256(chunk, _mm256_and_si256(upper, case_bit32)));
+	}
+#endif
+
+#if defined(__SSE2__)
+	__m128i below_a16 = _mm_set1_epi8('A' - 1);
+	__m128i above_z16 = _mm_set1_epi8('Z' + 1);
+	__m128i case_bit16 = _mm_set1_epi8(0x20);
+
+	// Bytes above 0x7f compare as negative, so they're never taken for letters
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((__m128i*)&src[i]);
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, below_a16), _mm_cmplt_epi8(chunk, above_z16));
+		_mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(chunk, _mm_and_si128(upper, case_bit16)));
+	}
+#endif
+
+	for (; i < len; i++)
+		dst[i] = src[i] >= 'A' && src[i] <= 'Z' ? src[i] | 0x20 : src[i];
+}
+
+// Fills in the folded names and their order, once the columns for them have been allocated.
+// Doing this once per listing means ignoring case costs a search nothing.
+static void sort_folded(Listing *l, int names_size) {
+	int n = l->n_entries;
+	fold_case(l->folded, l->names, names_size);
 
-		int ent_sz = strlen(ent->d_name) + 1;
-		char *str = allocate(&arena, ent_sz);
-
-		if (!str) {
-			// If there was enough room for the string
-			if (arena.idx <= arena.pool_size - ent_sz)
-				break;
-
-			int allocated = prev == NULL ? 0 : (int)(prev - l->first) + strlen(prev) + 1;
-			int size = allocated + ent_sz;
-			// If this set of entries takes up more room than a single pool
-			if (size > arena.pool_size)
-				break;
-
-			// Copy this set of entries over to the next pool
-			find_next_pool(&arena);
-			if (l->first && prev) {
-				char *start = l->first;
-				l->first = allocate(&arena, size);
-				memcpy(l->first, start, allocated);
-				str = &l->first[allocated];
+	Sort_Item *items = malloc(2 * n * sizeof(Sort_Item));
+	for (int i = 0; i < n; i++)
+		items[i] = (Sort_Item) { make_sort_key(FOLDED_NAME(l, i), false), i };
+
+	radix_sort(items, &items[n], n);
+	sort_ties(l, l->folded, items, n);
+
+	for (int i = 0; i < n; i++)
+		l->folded_sorted[i] = items[i].idx;
+
+	free(items);
+}
+
+// Listings that weren't read from a directory take their ids from here too, so that they're never mistaken for each other
+u32 new_listing_id() {
+	return __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+// Gives a listing that wasn't read from a directory its folded names, which must be packed in entry order
+void fold_entries(Listing *l, Arena *a) {
+	int n = l->n_entries;
+	if (n <= 0)
+		return;
+
+	int names_size = l->offsets[n-1] + l->lens[n-1] + 1;
+	l->folded_sorted = (int*)allocate(a, n * sizeof(int));
+	l->folded = allocate(a, names_size);
+
+	sort_folded(l, names_size);
+}
+
+// Fills in the index, the sorted orders and the folded names, once every column is in the listing's arena
+void sort_entries(Listing *l) {
+	int n = l->n_entries;
+	int names_size = l->offsets[n-1] + l->lens[n-1] + 1;
+
+	Sort_Item *items = malloc(2 * n * sizeof(Sort_Item));
+	for (int i = 0; i < n; i++)
+		items[i] = (Sort_Item) { make_sort_key(ENTRY_NAME(l, i), l->types[i] != DT_DIR), i };
+
+	radix_sort(items, &items[n], n);
+	sort_ties(l, l->names, items, n);
+
+	for (int i = 0; i < n; i++)
+		l->index[i] = items[i].idx;
+
+	// The index holds the directories and then everything else, each in name order,
+	//  so merging the two gives every entry in name order
+	int n_dirs = 0;
+	while (n_dirs < n && !(items[n_dirs].key & KEY_FILE_FLAG))
+		n_dirs++;
+
+	int d = 0, f = n_dirs;
+	for (int i = 0; i < n; i++) {
+		bool take_dir = f >= n;
+		if (!take_dir && d < n_dirs) {
+			u64 dir_key = items[d].key;
+			u64 file_key = items[f].key & ~KEY_FILE_FLAG;
+			take_dir = dir_key < file_key || (dir_key == file_key && strcmp(ENTRY_NAME(l, items[d].idx), ENTRY_NAME(l, items[f].idx)) < 0);
+		}
+
+		l->sorted[i] = take_dir ? items[d++].idx : items[f++].idx;
+	}
+
+	free(items);
+
+	sort_folded(l, names_size);
+}
+
+// The entries read from a directory so far.
+// Their names are left where getdents64 put them, and are only copied once it's known how big the listing is.
+typedef struct {
+	char **sources;
+	u32 *offsets;
+	u16 *lens;
+	u8 *types;
+	int n_entries;
+	// The entries whose type getdents64 didn't give, of which the first 'n_resolved' have since been looked up
+	int *unknown;
+	int n_unknown;
+	int n_resolved;
+} Gathered_Entries;
+
+// Puts the first 'n' gathered entries into 'l', in an arena of exactly the right size, so that it can be freed on its own.
+// The columns go in from the widest type to the narrowest, so none of them need padding.
+static void fill_listing(Listing *l, Gathered_Entries *g, int n) {
+	int names_size = g->offsets[n-1] + g->lens[n-1] + 1;
+	int size = n * (3 * sizeof(int) + sizeof(u32) + sizeof(u16) + sizeof(u8)) + 2 * names_size;
+	make_arena(size, &l->arena);
+
+	l->n_entries = n;
+	l->index = (int*)allocate(&l->arena, n * sizeof(int));
+	l->sorted = (int*)allocate(&l->arena, n * sizeof(int));
+	l->folded_sorted = (int*)allocate(&l->arena, n * sizeof(int));
+	l->offsets = (u32*)allocate(&l->arena, n * sizeof(u32));
+	l->lens = (u16*)allocate(&l->arena, n * sizeof(u16));
+	l->types = (u8*)allocate(&l->arena, n * sizeof(u8));
+	l->names = allocate(&l->arena, names_size);
+	l->folded = allocate(&l->arena, names_size);
+
+	memcpy(l->offsets, g->offsets, n * sizeof(u32));
+	memcpy(l->lens, g->lens, n * sizeof(u16));
+	memcpy(l->types, g->types, n * sizeof(u8));
+
+	for (int i = 0; i < n; i++)
+		memcpy(&l->names[g->offsets[i]], g->sources[i], g->lens[i] + 1);
+}
+
+static void show_partial_listing(int fd, Listing **shared, Listing *l, Gathered_Entries *g);
+
+// The layout of the records filled in by getdents64
+typedef struct {
+	u64 d_ino;
+	u64 d_off;
+	unsigned short d_reclen;
+	u8 d_type;
+	char d_name[];
+} Linux_Dirent;
+
+// Only the names of the directory records are kept, packed back to back so that each entry costs a few bytes besides its name.
+// The records are read into scratch space at the end of the thread's arena, and a directory too big for that
+//  gets further buffers, which are kept until the end so that every name is copied just once, straight into the listing.
+// If 'shared' is given, it points to the pending listing being read, which is replaced by what's been read so far as it grows.
+void get_directory_entries(int fd, Listing *l, Listing **shared) {
+	Gathered_Entries g = {0};
+	int cap = 0;
+	int names_size = 0;
+
+	char *buf = NULL;
+	char **extra_buffers = NULL;
+	int n_extra_buffers = 0;
+
+	// Only the file type is needed for sorting and drawing, which getdents64 usually provides for free.
+	// Entries whose type isn't known are looked up together, before each snapshot is shown and at the end.
+	int next_snapshot = FIRST_SNAPSHOT;
+
+	while (true) {
+		// The scratch space is never allocated, so it's reused by every read
+		if (!buf) {
+			align_arena();
+			buf = reserve(&arena, DIRENT_BUFFER_SIZE);
+		} else {
+			buf = malloc(DIRENT_BUFFER_SIZE);
+			extra_buffers = realloc(extra_buffers, (n_extra_buffers + 1) * sizeof(char*));
+			extra_buffers[n_extra_buffers++] = buf;
+		}
+
+		int size = syscall(SYS_getdents64, fd, buf, DIRENT_BUFFER_SIZE);
+		if (size <= 0)
+			break;
+
+		// More entries are still coming, so anyone waiting is shown the ones read so far.
+		// Each batch is a few times the size of the last, which keeps the extra sorting to a fraction of the final sort.
+		if (shared && g.n_entries >= next_snapshot) {
+			show_partial_listing(fd, shared, l, &g);
+			next_snapshot = g.n_entries * SNAPSHOT_GROWTH;
+		}
+
+		for (int pos = 0; pos < size; ) {
+			Linux_Dirent *ent = (Linux_Dirent*)&buf[pos];
+			pos += ent->d_reclen;
+
+			char *name = ent->d_name;
+			if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+				continue;
+
+			if (g.n_entries >= cap) {
+				cap = cap ? cap * 2 : 256;
+				g.sources = realloc(g.sources, cap * sizeof(char*));
+				g.offsets = realloc(g.offsets, cap * sizeof(u32));
+				g.lens = realloc(g.lens, cap * sizeof(u16));
+				g.types = realloc(g.types, cap * sizeof(u8));
+				g.unknown = realloc(g.unknown, cap * sizeof(int));
 			}
-			else
-				str = allocate(&arena, ent_sz);
+
+			if (ent->d_type == DT_UNKNOWN)
+				g.unknown[g.n_unknown++] = g.n_entries;
+
+			int len = strlen(name);
+			g.sources[g.n_entries] = name;
+			g.offsets[g.n_entries] = names_size;
+			g.lens[g.n_entries] = len;
+			g.types[g.n_entries] = ent->d_type;
+			g.n_entries++;
+
+			names_size += len + 1;
+		}
+	}
+
+	if (g.n_entries > 0) {
+		fill_listing(l, &g, g.n_entries);
+		fetch_entry_types(fd, l->names, l->offsets, &g.unknown[g.n_resolved], g.n_unknown - g.n_resolved, l->types);
+	}
+
+	for (int i = 0; i < n_extra_buffers; i++)
+		free(extra_buffers[i]);
+
+	free(extra_buffers);
+	free(g.sources);
+	free(g.offsets);
+	free(g.lens);
+	free(g.types);
+	free(g.unknown);
+}
+
+static void unwatch_listing(Listing *listing);
+
+// Removes the watch of a listing that couldn't be read, unless another listing of the same directory shares it
+static void drop_watch(Listing *l, Listing **shared) {
+	pthread_mutex_lock(&listings_lock);
+	if (shared)
+		(*shared)->watch = -1;
+	unwatch_listing(l);
+	pthread_mutex_unlock(&listings_lock);
+
+	l->watch = -1;
+}
+
+// Reads the directory at l->path into 'l'.
+// 'shared' points to the pending listing that the result is for, if anyone else can see it while it's being read.
+static bool read_listing(Listing *l, Listing **shared) {
+	char *path = l->path;
+	l->id = new_listing_id();
+
+	// Only a directory is watched, so that a path that isn't one doesn't leave a watch behind
+	struct stat s;
+	if (stat(path, &s) != 0 || (s.st_mode & S_IFMT) != S_IFDIR)
+		return false;
+
+	// The directory is watched before it's read, so that any changes made while reading aren't missed
+	l->watch = watch_fd >= 0 ? inotify_add_watch(watch_fd, path, WATCH_EVENTS) : -1;
+
+	if (shared) {
+		pthread_mutex_lock(&listings_lock);
+		(*shared)->watch = l->watch;
+		pthread_mutex_unlock(&listings_lock);
+	}
+
+	int fd = -1;
+	bool is_cached = find_cached_listing(path, &s, l);
+
+	if (!is_cached) {
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			drop_watch(l, shared);
+			return false;
+		}
+	}
+
+	l->dev = s.st_dev;
+	l->ino = s.st_ino;
+	l->mtime = s.st_mtim;
+
+	if (!is_cached) {
+		get_directory_entries(fd, l, shared);
+
+		close(fd);
+
+		if (l->n_entries > 0)
+			sort_entries(l);
+	}
+
+	return true;
+}
+
+// Expands a leading '~' and drops repeated and trailing slashes, so that every spelling of a directory gives the same key.
+// Returns the length of the path, or -1 if it doesn't fit.
+static int normalize_path(char *directory, int len, char *path, int size) {
+	int pos = 0;
+	int offset = 0;
+
+	if (len > 0 && directory[0] == '~') {
+		char *home = get_home_directory();
+		if (home) {
+			pos = strlen(home);
+			if (pos >= size)
+				return -1;
+
+			memcpy(path, home, pos);
+			offset = 1;
+		}
+	}
+
+	for (int i = offset; i < len && directory[i]; i++) {
+		if (directory[i] == '/' && pos > 0 && path[pos-1] == '/')
+			continue;
+		if (pos >= size - 1)
+			return -1;
+
+		path[pos++] = directory[i];
+	}
+
+	while (pos > 1 && path[pos-1] == '/')
+		pos--;
+
+	path[pos] = 0;
+	return pos;
+}
+
+// Marks the calling thread as reading, so that nothing it's given is freed until it calls release_listings().
+// A thread that doesn't get a slot is covered only by the delay until the trim after next, as the window is.
+static void begin_reading() {
+	if (reader_id < 0) {
+		int id = __atomic_fetch_add(&n_readers, 1, __ATOMIC_RELAXED);
+		reader_id = id < MAX_READERS ? id : MAX_READERS;
+	}
+
+	if (reader_id < MAX_READERS && !readers[reader_id].epoch)
+		__atomic_store_n(&readers[reader_id].epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+// Tells that the calling thread is done with every listing it's been given
+void release_listings() {
+	if (reader_id >= 0 && reader_id < MAX_READERS)
+		__atomic_store_n(&readers[reader_id].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Safe to call without the lock, though a listing that's being moved within the table may be missed,
+//  in which case the caller has to look again with the lock held
+static Listing *find_listing(char *path, u32 hash) {
+	Listing_Table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+	if (!t)
+		return NULL;
+
+	int mask = t->n_slots - 1;
+	for (int s = hash & mask; ; s = (s + 1) & mask) {
+		Listing *l = __atomic_load_n(&t->slots[s], __ATOMIC_ACQUIRE);
+		if (!l)
+			return NULL;
+		if (l->hash == hash && !strcmp(l->path, path))
+			return l;
+	}
+}
+
+static void place_listing(Listing_Table *t, Listing *l) {
+	int mask = t->n_slots - 1;
+	int s = l->hash & mask;
+	while (t->slots[s])
+		s = (s + 1) & mask;
+
+	__atomic_store_n(&t->slots[s], l, __ATOMIC_RELEASE);
+}
+
+static void add_retired(Retired r) {
+	Retired *copy = malloc(sizeof(Retired));
+	*copy = r;
+	copy->epoch = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+	copy->next = retired;
+	retired = copy;
+}
+
+// Hands the listing's memory over to be freed once nobody can be holding it, along with the listing itself if it's given.
+// The listings lock must be held before calling this.
+static void retire(Arena *a, Listing *listing) {
+	if (!a->chain && !listing)
+		return;
+
+	add_retired((Retired) {
+		.arena = *a,
+		.listing = listing
+	});
+
+	memory_used -= a->size;
+}
+
+// The listings lock must be held before calling this
+static void add_listing(Listing *l) {
+	int n_slots = table ? table->n_slots : 0;
+
+	if ((n_used + 1) * 4 > n_slots * 3) {
+		int n_table = n_slots ? n_slots * 2 : 64;
+		Listing_Table *t = calloc(1, sizeof(Listing_Table) + n_table * sizeof(Listing*));
+		t->n_slots = n_table;
+
+		for (int i = 0; i < n_slots; i++) {
+			if (table->slots[i])
+				place_listing(t, table->slots[i]);
+		}
+
+		// Anyone still looking through the old table finds the same listings there
+		if (table)
+			add_retired((Retired) { .table = table });
+
+		__atomic_store_n(&table, t, __ATOMIC_RELEASE);
+	}
+
+	place_listing(table, l);
+	n_used++;
+
+	*list_head = l;
+	list_head = &l->next;
+}
+
+// The listings lock must be held before calling this
+static void remove_listing(Listing *listing) {
+	Listing **prev = &listings;
+	while (*prev != listing)
+		prev = &(*prev)->next;
+
+	*prev = listing->next;
+	if (list_head == &listing->next)
+		list_head = prev;
+
+	Listing **slots = table->slots;
+	int mask = table->n_slots - 1;
+	int hole = listing->hash & mask;
+	while (slots[hole] != listing)
+		hole = (hole + 1) & mask;
+
+	// Listings further along the probe sequence are shifted back into the hole,
+	//  unless that would put them in front of their home slot.
+	// Each one is copied before its old slot is reused, so a reader can miss it but never finds anything else.
+	for (int s = (hole + 1) & mask; slots[s]; s = (s + 1) & mask) {
+		int home = slots[s]->hash & mask;
+		if (((s - home) & mask) >= ((s - hole) & mask)) {
+			__atomic_store_n(&slots[hole], slots[s], __ATOMIC_RELEASE);
+			hole = s;
 		}
+	}
+
+	__atomic_store_n(&slots[hole], NULL, __ATOMIC_RELEASE);
+	n_used--;
+
+	if (listing->prefetched)
+		__atomic_sub_fetch(&n_prefetched, listing->n_entries, __ATOMIC_RELAXED);
+}
+
+// Puts a new listing in the place of one that's in the table, and retires the old one along with its memory.
+// The listings lock must be held before calling this.
+static void replace_listing(Listing *old, Listing *l) {
+	Listing **slots = table->slots;
+	int mask = table->n_slots - 1;
+	int s = old->hash & mask;
+	while (slots[s] != old)
+		s = (s + 1) & mask;
+
+	__atomic_store_n(&slots[s], l, __ATOMIC_RELEASE);
+
+	Listing **prev = &listings;
+	while (*prev != old)
+		prev = &(*prev)->next;
+
+	l->next = old->next;
+	*prev = l;
+	if (list_head == &old->next)
+		list_head = &l->next;
+
+	// A listing that was prefetched stays counted as one each time it's read again
+	if (old->prefetched) {
+		l->prefetched = true;
+		__atomic_add_fetch(&n_prefetched, l->n_entries - old->n_entries, __ATOMIC_RELAXED);
+	}
+
+	retire(&old->arena, old);
+}
+
+// Copies a listing that's been read into memory of its own, so that it can be put in the table
+static Listing *make_listing(Listing *fresh) {
+	Listing *l = malloc(sizeof(Listing));
+	*l = *fresh;
+	l->path = strdup(fresh->path);
+	return l;
+}
+
+// Gives out everything in the listing that can't change once it's in the table
+static void copy_listing(Listing *info, Listing *l) {
+	memset(info, 0, sizeof(Listing));
+	memcpy(info, l, offsetof(Listing, next));
+}
+
+static void touch_listing(Listing *l) {
+	__atomic_store_n(&l->last_used, __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+// Whoever is reading a listing that's been given out while pending has to tell when there's more of it.
+// The listing may have just been replaced, so this is called after the new one is in the table, and reads the old one's flag.
+static bool is_late(Listing *old, Listing *l) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bool late = __atomic_load_n(&old->late, __ATOMIC_RELAXED);
+	if (late && l)
+		__atomic_store_n(&l->late, true, __ATOMIC_RELAXED);
+
+	return late;
+}
+
+// The listings lock must be held before calling this.
+// The listing is added as pending, so that anyone else who wants it waits for the caller to read it.
+static Listing *add_pending_listing(char *path, int path_len, u32 hash) {
+	Listing *l = calloc(1, sizeof(Listing));
+
+	l->path = malloc(path_len + 1);
+	memcpy(l->path, path, path_len + 1);
+	l->hash = hash;
+	l->pending = true;
+	touch_listing(l);
+
+	add_listing(l);
+	return l;
+}
 
-		strcpy(str, ent->d_name);
+// Sorts a copy of the entries that have been read so far, and puts it in the table in place of the pending listing,
+//  so that a huge directory can be shown long before it's been read to the end
+static void show_partial_listing(int fd, Listing **shared, Listing *l, Gathered_Entries *g) {
+	Listing snapshot = {
+		.path = (*shared)->path,
+		.hash = (*shared)->hash,
+		.watch = l->watch,
+		.id = new_listing_id(),
+		.pending = true,
+		.partial = true
+	};
+	fill_listing(&snapshot, g, g->n_entries);
+
+	// Types are looked up before the entries are sorted, so that directories are shown as directories.
+	// They're kept for the rest of the read, so that none of them is looked up twice.
+	int *which = &g->unknown[g->n_resolved];
+	int n_new = g->n_unknown - g->n_resolved;
+	fetch_entry_types(fd, snapshot.names, snapshot.offsets, which, n_new, snapshot.types);
+
+	for (int i = 0; i < n_new; i++)
+		g->types[which[i]] = snapshot.types[which[i]];
+	g->n_resolved = g->n_unknown;
+
+	sort_entries(&snapshot);
+
+	pthread_mutex_lock(&listings_lock);
+
+	Listing *old = *shared;
+	Listing *partial = make_listing(&snapshot);
+	partial->last_used = __atomic_load_n(&old->last_used, __ATOMIC_RELAXED);
+	memory_used += snapshot.arena.size;
+
+	replace_listing(old, partial);
+	*shared = partial;
+
+	bool late = is_late(old, partial);
+	if (late)
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+
+	pthread_cond_broadcast(&listing_ready);
+	pthread_mutex_unlock(&listings_lock);
+
+	u64 one = 1;
+	if (late && notify_fd >= 0)
+		write(notify_fd, &one, sizeof(u64));
+}
 
-		l->n_entries++;
-		if (!l->first)
-			l->first = str;
+// Reads a pending listing and hands it to everyone waiting for it.
+// The pending listing is replaced along the way, so it mustn't be looked at once this returns.
+static bool publish_listing(Listing *l, Listing *info) {
+	// Partial listings replace the pending one while it's read, and each is retired in turn, so the path is kept apart
+	char *path = strdup(l->path);
+	Listing fresh = {
+		.path = path,
+		.hash = l->hash
+	};
+	bool found = read_listing(&fresh, &l);
+
+	pthread_mutex_lock(&listings_lock);
+
+	// Anyone who gave up on this listing is holding an empty or partial one, and needs to be told to look again
+	bool late;
+
+	if (found) {
+		Listing *done = make_listing(&fresh);
+		done->last_used = __atomic_load_n(&l->last_used, __ATOMIC_RELAXED);
+		memory_used += fresh.arena.size;
+
+		replace_listing(l, done);
+		late = is_late(l, done);
+		l = done;
+	}
+	else {
+		remove_listing(l);
+		retire(&l->arena, l);
+		late = is_late(l, NULL);
+	}
 
-		prev = str;
+	if (info) {
+		if (found)
+			copy_listing(info, l);
+		else
+			memset(info, 0, sizeof(Listing));
 	}
 
-	arena.allow_overflow = true;
+	if (late)
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+
+	pthread_cond_broadcast(&listing_ready);
+	pthread_mutex_unlock(&listings_lock);
+
+	u64 one = 1;
+	if (late && notify_fd >= 0)
+		write(notify_fd, &one, sizeof(u64));
+
+	free(path);
+	return found;
+}
+
+static void read_listing_detached(void *arg) {
+	Listing *l = (Listing*)arg;
+
+	pthread_mutex_lock(&listings_lock);
+	if (n_idle_arenas > 0)
+		arena = idle_arenas[--n_idle_arenas];
+	pthread_mutex_unlock(&listings_lock);
+
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Once it's published, the listing can be removed and freed at any time, so it can't be looked at afterwards
+	char *path = strdup(l->path);
+	publish_listing(l, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	end_mount_read(path, ms <= IO_DEADLINE_MS);
+	free(path);
+
+	pthread_mutex_lock(&listings_lock);
+	bool kept = n_idle_arenas < MAX_IDLE_ARENAS;
+	if (kept)
+		idle_arenas[n_idle_arenas++] = arena;
+	pthread_mutex_unlock(&listings_lock);
+
+	// The arena only ever holds scratch space, so one that isn't kept is of no use to anyone
+	if (!kept)
+		free_arena(&arena);
+}
+
+static void read_listing_job(void *arg) {
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
+
+	publish_listing((Listing*)arg, NULL);
+}
+
+// Looks up a listing that's already been read, without taking the lock.
+// A partial listing is only given if 'partial_ok', in which case whoever is reading the rest of it is asked to tell when there's more.
+static bool find_published_listing(char *path, u32 hash, Listing *info, bool partial_ok) {
+	while (true) {
+		Listing *l = find_listing(path, hash);
+		if (!l || (l->pending && !(partial_ok && l->partial)))
+			return false;
+
+		// If the listing was replaced before its reader could see the flag, the new one is asked instead
+		if (l->pending) {
+			__atomic_store_n(&l->late, true, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (find_listing(path, hash) != l)
+				continue;
+		}
+
+		touch_listing(l);
+		copy_listing(info, l);
+		return true;
+	}
 }
 
 bool list_directory(char *directory, int len, Listing *info) {
 	if (len < 0)
 		len = strlen(directory);
 
-	if (listings) {
-		Listing *l = listings;
-		while (l) {
-			if (l->name && !strncmp(directory, l->name, len)) {
-				memcpy(info, l, sizeof(Listing));
-				return true;
-			}
-			l = l->next;
-		}
-	}
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
 
-	DIR *d = NULL;
 	char path[4096];
+	int path_len = normalize_path(directory, len, path, sizeof(path));
+	if (path_len <= 0) {
+		memset(info, 0, sizeof(Listing));
+		return false;
+	}
 
-	if (directory[0] == '~') {
-		char *home = get_home_directory();
-		int home_len = strlen(home);
+	u32 hash = hash_string(path, path_len);
 
-		strcpy(path, home);
-		strncpy(&path[home_len], &directory[1], len);
-		path[home_len + len] = 0;
+	begin_reading();
+	if (find_published_listing(path, hash, info, false))
+		return true;
+
+	pthread_mutex_lock(&listings_lock);
 
-		d = opendir(path);
+	// If another thread is already reading this directory, wait for it instead of reading it twice
+	Listing *l = find_listing(path, hash);
+	while (l && l->pending) {
+		pthread_cond_wait(&listing_ready, &listings_lock);
+		l = find_listing(path, hash);
 	}
-	else {
-		strncpy(path, directory, len);
-		path[len] = 0;
+
+	if (l) {
+		touch_listing(l);
+		copy_listing(info, l);
+		pthread_mutex_unlock(&listings_lock);
+		return true;
 	}
 
-	d = opendir(path);
-	if (!d) {
+	l = add_pending_listing(path, path_len, hash);
+
+	pthread_mutex_unlock(&listings_lock);
+
+	return publish_listing(l, info);
+}
+
+// Like list_directory, but for callers that can't afford to block on a slow mount.
+// The directory is read by a worker, or on a thread of its own if its mount might hang, and once 'timeout_ms' has passed, the listing is given back empty
+//  and marked as pending. The read carries on, and get_listing_notify_fd() is signalled once it's ready.
+// A huge directory is given back as soon as part of it has been read, marked as both pending and partial,
+//  and the notify fd is signalled again as each bigger part and then the whole listing is ready.
+bool list_directory_within(char *directory, int len, Listing *info, int timeout_ms) {
+	if (len < 0)
+		len = strlen(directory);
+
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
+
+	char path[4096];
+	int path_len = normalize_path(directory, len, path, sizeof(path));
+	if (path_len <= 0) {
 		memset(info, 0, sizeof(Listing));
 		return false;
 	}
 
-	Listing *l = (Listing*)allocate(&arena, sizeof(Listing));
-	*list_head = l;
-	list_head = &l->next;
+	u32 hash = hash_string(path, path_len);
 
-	memset(l, 0, sizeof(Listing));
-	l->name = allocate(&arena, len + 1);
-	memcpy(l->name, directory, len + 1);
+	// The lock is only needed when the listing has yet to be read
+	begin_reading();
+	if (find_published_listing(path, hash, info, true))
+		return true;
 
-	get_directory_entries(d, l);
+	pthread_mutex_lock(&listings_lock);
 
-	closedir(d);
+	// On a mount that's already being probed, nothing is read at all
+	bool busy = false;
 
-	if (l->n_entries > 0)
-		sort_entries(l, path);
+	Listing *l = find_listing(path, hash);
+	if (!l) {
+		int state = check_mount(path);
+		if (state == MOUNT_SLOW)
+			timeout_ms = 0;
 
-	memcpy(info, l, sizeof(Listing));
-	return true;
+		if (state == MOUNT_BUSY)
+			busy = true;
+		else {
+			l = add_pending_listing(path, path_len, hash);
+			pthread_mutex_unlock(&listings_lock);
+
+			// A local directory can't hang, so it doesn't need a thread of its own
+			if (state == MOUNT_LOCAL)
+				submit_job(read_listing_job, l);
+			else
+				run_detached(read_listing_detached, l);
+
+			// The read may already be over, with the pending listing replaced by the one that was read
+			pthread_mutex_lock(&listings_lock);
+			l = find_listing(path, hash);
+		}
+	}
+	// Once someone has given up on a listing, there's no point in waiting for it again
+	else if (__atomic_load_n(&l->late, __ATOMIC_RELAXED))
+		timeout_ms = 0;
+
+	struct timespec deadline = get_deadline(timeout_ms);
+	while (l && l->pending && !l->partial && pthread_cond_timedwait(&listing_ready, &listings_lock, &deadline) != ETIMEDOUT)
+		l = find_listing(path, hash);
+
+	// The listing may have been removed just as the wait ran out
+	if (l)
+		l = find_listing(path, hash);
+
+	bool timed_out = false;
+
+	if (l && (!l->pending || l->partial)) {
+		touch_listing(l);
+		copy_listing(info, l);
+
+		// Whoever is holding part of a listing needs to be told when there's more of it
+		if (l->pending)
+			__atomic_store_n(&l->late, true, __ATOMIC_RELAXED);
+	}
+	else {
+		memset(info, 0, sizeof(Listing));
+
+		if (l) {
+			timed_out = timeout_ms > 0 && !__atomic_load_n(&l->late, __ATOMIC_RELAXED);
+			__atomic_store_n(&l->late, true, __ATOMIC_RELAXED);
+			info->path = l->path;
+		}
+		info->pending = l || busy;
+	}
+
+	pthread_mutex_unlock(&listings_lock);
+
+	if (timed_out)
+		record_timeout(path);
+
+	return l || busy;
+}
+
+int get_directory_watch() {
+	return watch_fd;
+}
+
+int get_listing_notify_fd() {
+	return notify_fd;
+}
+
+int get_listings_generation() {
+	return __atomic_load_n(&generation, __ATOMIC_RELAXED);
+}
+
+// Marks every listing that belongs to a watched directory that has changed.
+// The listings lock must be held before calling this.
+static bool mark_stale_listings(struct inotify_event *event) {
+	bool found = false;
+	for (Listing *l = listings; l; l = l->next) {
+		if (!l->pending && (l->watch == event->wd || (event->mask & IN_Q_OVERFLOW))) {
+			l->stale = true;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// The listings lock must be held before calling this
+static void unwatch_listing(Listing *listing) {
+	if (listing->watch < 0)
+		return;
+
+	// Another path to the same directory shares its watch
+	for (Listing *l = listings; l; l = l->next) {
+		if (l->watch == listing->watch)
+			return;
+	}
+
+	inotify_rm_watch(watch_fd, listing->watch);
+}
+
+// A pending listing found in the table belongs to whoever is reading it, so it's left alone
+static Listing *find_read_listing(char *path, u32 hash) {
+	Listing *l = find_listing(path, hash);
+	return l && !l->pending ? l : NULL;
+}
+
+// Reads a listing that's changed again, on a worker, and puts the new one in its place.
+// Anything that changes while it's being read marks it as stale again, in which case it's read once more.
+static void refresh_listing(void *arg) {
+	char *path = (char*)arg;
+	u32 hash = hash_string(path, strlen(path));
+
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
+
+	bool again = true;
+	while (again) {
+		pthread_mutex_lock(&listings_lock);
+		Listing *l = find_read_listing(path, hash);
+		if (l)
+			l->stale = false;
+		pthread_mutex_unlock(&listings_lock);
+
+		if (!l)
+			break;
+
+		Listing fresh = {
+			.path = path,
+			.hash = hash
+		};
+		bool found = read_listing(&fresh, NULL);
+
+		pthread_mutex_lock(&listings_lock);
+
+		// The listing may have been evicted while it was being read
+		l = find_read_listing(path, hash);
+		again = false;
+
+		if (l && found) {
+			Listing *updated = make_listing(&fresh);
+			updated->last_used = __atomic_load_n(&l->last_used, __ATOMIC_RELAXED);
+			updated->stale = l->stale;
+			updated->refreshing = again = l->stale;
+			memory_used += fresh.arena.size;
+
+			replace_listing(l, updated);
+		}
+		else if (l) {
+			remove_listing(l);
+			retire(&l->arena, l);
+		}
+		else if (found) {
+			unwatch_listing(&fresh);
+			if (fresh.arena.chain)
+				free_arena(&fresh.arena);
+		}
+
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&listings_lock);
+
+		u64 one = 1;
+		if (notify_fd >= 0)
+			write(notify_fd, &one, sizeof(u64));
+	}
+
+	free(path);
+}
+
+// Reads any pending directory change notifications, and has the listings they refer to read again by the workers.
+// get_listing_notify_fd() is signalled as each of them is replaced.
+void update_listings() {
+	if (watch_fd < 0)
+		return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+
+	int size;
+	while ((size = read(watch_fd, buf, sizeof(buf))) > 0) {
+		pthread_mutex_lock(&listings_lock);
+
+		char *p = buf;
+		while (p < &buf[size]) {
+			struct inotify_event *event = (struct inotify_event*)p;
+			if ((event->mask & IN_IGNORED) == 0)
+				changed = mark_stale_listings(event) || changed;
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+
+		pthread_mutex_unlock(&listings_lock);
+	}
+
+	if (!changed)
+		return;
+
+	// The jobs are submitted once the lock is let go, since without any workers they run right away
+	pthread_mutex_lock(&listings_lock);
+
+	int n = 0;
+	for (Listing *l = listings; l; l = l->next)
+		n++;
+
+	char **paths = malloc((n + 1) * sizeof(char*));
+	int n_paths = 0;
+
+	for (Listing *l = listings; l; l = l->next) {
+		if (l->stale && !l->pending && !l->refreshing) {
+			l->refreshing = true;
+			paths[n_paths++] = strdup(l->path);
+		}
+	}
+
+	pthread_mutex_unlock(&listings_lock);
+
+	for (int i = 0; i < n_paths; i++)
+		submit_job(refresh_listing, paths[i]);
+
+	free(paths);
+}
+
+void set_listing_budget(u64 bytes) {
+	memory_budget = bytes;
+}
+
+static int compare_last_used(const void *p1, const void *p2) {
+	u64 a = __atomic_load_n(&(*(Listing**)p1)->last_used, __ATOMIC_RELAXED);
+	u64 b = __atomic_load_n(&(*(Listing**)p2)->last_used, __ATOMIC_RELAXED);
+	return a < b ? -1 : a > b;
+}
+
+// Evicts the least recently used listings until the rest fit within the memory budget,
+//  and frees the memory of listings that nobody can still be holding.
+// A listing handed out since the trim before the last is never evicted, since it's likely to be wanted again soon.
+// This must only be called from the window's thread, and only once the window has taken a new listing since the last trim.
+// It tells that the window is done with everything it was given before the listing it took last.
+void trim_listings() {
+	release_listings();
+
+	pthread_mutex_lock(&listings_lock);
+
+	if (memory_used > memory_budget) {
+		int n = 0;
+		for (Listing *l = listings; l; l = l->next)
+			n++;
+
+		Listing **victims = malloc(n * sizeof(Listing*));
+		int n_victims = 0;
+
+		for (Listing *l = listings; l; l = l->next) {
+			if (!l->pending && l->arena.size && __atomic_load_n(&l->last_used, __ATOMIC_RELAXED) <= prev_trim)
+				victims[n_victims++] = l;
+		}
+
+		qsort(victims, n_victims, sizeof(Listing*), compare_last_used);
+
+		for (int i = 0; i < n_victims && memory_used > memory_budget; i++) {
+			Listing *l = victims[i];
+			remove_listing(l);
+			unwatch_listing(l);
+			retire(&l->arena, l);
+		}
+
+		free(victims);
+	}
+
+	prev_trim = last_trim;
+	last_trim = __atomic_load_n(&use_clock, __ATOMIC_RELAXED);
+
+	// Whatever was retired since the last trim may still be held by the window.
+	// Threads that are reading hold on to everything retired since they started.
+	u64 now = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	u64 oldest = now - 1;
+
+	int n = n_readers < MAX_READERS ? n_readers : MAX_READERS;
+	for (int i = 0; i < n; i++) {
+		u64 e = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+		if (e && e < oldest)
+			oldest = e;
+	}
+
+	Retired *expired = NULL;
+	Retired **prev = &retired;
+	while (*prev) {
+		Retired *r = *prev;
+		if (r->epoch < oldest) {
+			*prev = r->next;
+			r->next = expired;
+			expired = r;
+		}
+		else
+			prev = &r->next;
+	}
+
+	pthread_mutex_unlock(&listings_lock);
+
+	while (expired) {
+		Retired *next = expired->next;
+		if (expired->arena.chain)
+			free_arena(&expired->arena);
+		if (expired->listing) {
+			free(expired->listing->path);
+			free(expired->listing);
+		}
+		free(expired->table);
+		free(expired);
+		expired = next;
+	}
+}
+
+static void scan_directory(void *directory) {
+	Listing list;
+	list_directory_within((char*)directory, -1, &list, IO_DEADLINE_MS);
+}
+
+// Reads every directory in $PATH across the worker pool, so that they're ready by the time they're needed
+void scan_path_directories() {
+	submit_job(scan_directory, BINARIES_DIR);
+
+	char *bin_path = getenv("PATH");
+	if (!bin_path)
+		return;
+
+	char *next = bin_path;
+	char *p = &bin_path[-1];
+	do {
+		p++;
+		if (*p != ':' && *p != 0)
+			continue;
+
+		int len = p - next;
+		if (len > 0) {
+			char *dir = allocate(&arena, len + 1);
+			memcpy(dir, next, len);
+			dir[len] = 0;
+			submit_job(scan_directory, dir);
+		}
+
+		next = p + 1;
+	} while (*p);
+}
+
+static void prefetch_directory(void *arg) {
+	char path[4096];
+	int path_len = normalize_path((char*)arg, strlen((char*)arg), path, sizeof(path));
+	free(arg);
+
+	if (path_len <= 0 || __atomic_load_n(&n_prefetched, __ATOMIC_RELAXED) >= PREFETCH_BUDGET)
+		return;
+
+	// Only a listing that prefetching added to the table counts against the budget
+	u32 hash = hash_string(path, path_len);
+	pthread_mutex_lock(&listings_lock);
+	bool known = find_listing(path, hash);
+	pthread_mutex_unlock(&listings_lock);
+
+	Listing list;
+	if (known || !list_directory_within(path, path_len, &list, IO_DEADLINE_MS))
+		return;
+
+	pthread_mutex_lock(&listings_lock);
+	Listing *l = find_listing(path, hash);
+	if (l && !l->prefetched) {
+		l->prefetched = true;
+		__atomic_add_fetch(&n_prefetched, l->n_entries, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&listings_lock);
+}
+
+// Lists the first few subdirectories among the given entries in the background, so that they're ready if the user descends into one.
+// Any prefetches that haven't started by the next call are dropped, since the user will have moved on.
+void prefetch_subdirectories(Listing *listing, int *entries, int n_entries) {
+	cancel_background_jobs();
+
+	if (!listing->path || __atomic_load_n(&n_prefetched, __ATOMIC_RELAXED) >= PREFETCH_BUDGET)
+		return;
+
+	int path_len = strlen(listing->path);
+	int n_queued = 0;
+
+	for (int i = 0; i < n_entries && i < PREFETCH_SCAN && n_queued < PREFETCH_COUNT; i++) {
+		int idx = entries[i];
+		if (listing->types[idx] != DT_DIR)
+			continue;
+
+		char *name = ENTRY_NAME(listing, idx);
+		int name_len = listing->lens[idx];
+
+		char *path = malloc(path_len + name_len + 2);
+		memcpy(path, listing->path, path_len);
+		path[path_len] = '/';
+		memcpy(&path[path_len + 1], name, name_len + 1);
+
+		submit_background_job(prefetch_directory, path);
+		n_queued++;
+	}
+}
+
+void save_directory_cache() {
+	// Listings still being read on a hung mount are skipped by the cache, and the lock keeps them from changing underneath it
+	pthread_mutex_lock(&listings_lock);
+
+	for (Listing *l = listings; l; l = l->next) {
+		if (!l->from_cache && !l->pending) {
+			write_listing_cache(listings);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&listings_lock);
 }
 
 char *home_dir = NULL;
@@ -210,6 +1448,9 @@ char *get_desugared_path(char *str, int len) {
 
 	len -= offset;
 
+	if (!arena.initialized)
+		make_arena(POOL_SIZE, &arena);
+
 	char *path = allocate(&arena, len + home_len + 1);
 
 	if (home) strcpy(path, home);
@@ -219,60 +1460,3 @@ char *get_desugared_path(char *str, int len) {
 
 	return path;
 }
-
-bool find_program(char *name, char **error_str) {
-	char *bin_path = getenv("PATH");
-	char *next = bin_path;
-	char file[200];
-
-	char *p = &bin_path[-1];
-	do {
-		p++;
-		if (*p != ':' && *p != 0)
-			continue;
-
-		char *path = next;
-		next = p + 1;
-
-		int len = p - path;
-		Listing list;
-		list_directory(path, len, &list);
-
-		bool found = false;
-		for (int i = 0; i < list.n_entries; i++) {
-			if (!strcmp(list.table[i], name)) {
-				found = true;
-				break;
-			}
-		}
-		if (!found) {
-			if (error_str) *error_str = "command not found: ";
-			continue;
-		}
-
-		if (error_str) *error_str = NULL;
-
-		sprintf(file, "%.*s/%s", len, path, name);
-
-		struct stat s;
-		if (stat(file, &s) != 0) {
-			if (error_str) *error_str = "command not found: ";
-			break;
-		}
-
-		if ((s.st_mode & S_IFMT) == S_IFDIR) {
-			if (error_str) *error_str = "not a regular file: ";
-			break;
-		}
-
-		if ((s.st_mode & S_IXUSR) == 0) {
-			if (error_str) *error_str = "missing execute permission: ";
-			break;
-		}
-
-		return true;
-
-	} while (*p);
-
-	return false;
-}
@@ -0,0 +1,202 @@
+// Remembers how often and how recently each program and path was launched ("frecency"), for ranking search results.
+// The table lives in a memory-mapped file of hashed keys, so looking up an entry costs one probe sequence and no I/O.
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define FRECENCY_FILE  "~/.cache/pistachio/frecency"
+
+#define FRECENCY_MAGIC    0x63726670 // "pfrc"
+#define FRECENCY_VERSION  1
+#define INITIAL_SLOTS     1024
+
+#define FNV64_OFFSET  14695981039346656037ull
+#define FNV64_PRIME   1099511628211ull
+
+#define HOUR  (60 * 60)
+#define DAY   (24 * HOUR)
+#define WEEK  (7 * DAY)
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 n_slots;
+	u32 n_used;
+} Frecency_Header;
+
+typedef struct {
+	u64 key;
+	u32 count;
+	u32 last_used;
+} Frecency_Slot;
+
+static Frecency_Header *table = NULL;
+static Frecency_Slot *slots = NULL;
+static int table_size = 0;
+
+static char *frecency_path = NULL;
+static u32 now = 0;
+
+static int get_table_size(int n_slots) {
+	return sizeof(Frecency_Header) + n_slots * sizeof(Frecency_Slot);
+}
+
+static bool map_table(int fd, int size) {
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+
+	Frecency_Header *header = (Frecency_Header*)map;
+	if (header->magic != FRECENCY_MAGIC || header->version != FRECENCY_VERSION ||
+		header->n_slots == 0 || (header->n_slots & (header->n_slots - 1)) ||
+		get_table_size(header->n_slots) != size
+	) {
+		munmap(map, size);
+		return false;
+	}
+
+	if (table)
+		munmap(table, table_size);
+
+	table = header;
+	slots = (Frecency_Slot*)&header[1];
+	table_size = size;
+	return true;
+}
+
+void open_frecency() {
+	frecency_path = get_desugared_path(FRECENCY_FILE, strlen(FRECENCY_FILE));
+	now = time(NULL);
+
+	int fd = open(frecency_path, O_RDWR);
+	if (fd < 0)
+		return;
+
+	struct stat s;
+	if (fstat(fd, &s) == 0)
+		map_table(fd, s.st_size);
+
+	close(fd);
+}
+
+// FNV-1a, continued from a previous key so that paths can be hashed a piece at a time
+u64 frecency_key(u64 key, char *str, int len) {
+	if (!key)
+		key = FNV64_OFFSET;
+
+	for (int i = 0; len < 0 ? str[i] : i < len; i++)
+		key = (key ^ (u8)str[i]) * FNV64_PRIME;
+
+	// zero marks an empty slot
+	return key ? key : 1;
+}
+
+// Gives the key that the names in this listing continue from.
+// Programs are keyed by name, while everything else is keyed by its full path.
+u64 get_listing_key(Listing *listing) {
+	if (!listing->path)
+		return 0;
+
+	int len = strlen(listing->path);
+	while (len > 0 && listing->path[len-1] == '/')
+		len--;
+
+	u64 key = frecency_key(0, listing->path, len);
+	return frecency_key(key, "/", 1);
+}
+
+static Frecency_Slot *find_slot(Frecency_Slot *table_slots, int n_slots, u64 key) {
+	int s = key & (n_slots - 1);
+	for (int i = 0; i < n_slots; i++) {
+		if (!table_slots[s].key || table_slots[s].key == key)
+			return &table_slots[s];
+
+		s = (s + 1) & (n_slots - 1);
+	}
+
+	return NULL;
+}
+
+// Rewrites the table into a new file with the given number of slots
+static bool resize_table(int n_slots) {
+	int size = get_table_size(n_slots);
+	char *buf = calloc(1, size);
+	if (!buf)
+		return false;
+
+	*(Frecency_Header*)buf = (Frecency_Header) {
+		.magic = FRECENCY_MAGIC,
+		.version = FRECENCY_VERSION,
+		.n_slots = n_slots,
+		.n_used = table ? table->n_used : 0
+	};
+
+	Frecency_Slot *new_slots = (Frecency_Slot*)&buf[sizeof(Frecency_Header)];
+	for (int i = 0; table && i < table->n_slots; i++) {
+		if (slots[i].key)
+			*find_slot(new_slots, n_slots, slots[i].key) = slots[i];
+	}
+
+	int path_len = strlen(frecency_path);
+	char temp_path[path_len + 5];
+	memcpy(temp_path, frecency_path, path_len);
+	strcpy(&temp_path[path_len], ".tmp");
+
+	create_parent_directories(frecency_path);
+
+	bool ok = false;
+	int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		ok = write(fd, buf, size) == size && rename(temp_path, frecency_path) == 0;
+		ok = ok && map_table(fd, size);
+		close(fd);
+	}
+
+	free(buf);
+	return ok;
+}
+
+void record_launch(u64 key) {
+	if (!frecency_path)
+		return;
+
+	if (!table && !resize_table(INITIAL_SLOTS))
+		return;
+
+	if ((table->n_used + 1) * 4 > table->n_slots * 3 && !resize_table(table->n_slots * 2))
+		return;
+
+	Frecency_Slot *slot = find_slot(slots, table->n_slots, key);
+	if (!slot)
+		return;
+
+	if (!slot->key) {
+		slot->key = key;
+		table->n_used++;
+	}
+
+	if (slot->count < 0xffffffff)
+		slot->count++;
+
+	slot->last_used = time(NULL);
+}
+
+// Gives the launch count of an entry, weighted by how long ago it was last launched
+int get_frecency(u64 listing_key, char *name) {
+	if (!table)
+		return 0;
+
+	Frecency_Slot *slot = find_slot(slots, table->n_slots, frecency_key(listing_key, name, -1));
+	if (!slot || !slot->key)
+		return 0;
+
+	int age = (int)(now - slot->last_used);
+	int weight = age < HOUR ? 16 : age < DAY ? 8 : age < WEEK ? 4 : 1;
+
+	u32 score = slot->count * weight;
+	return score < 0x7fffffff ? score : 0x7fffffff;
+}
@@ -0,0 +1,410 @@
+// Subsequence ("fuzzy") matching and ranking, in the style of fzf.
+// Every query character must appear in the name in order. Matches are then scored on
+//  how many characters land on word boundaries, how many run consecutively and how big the gaps are.
+
+#include <ctype.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "pistachio.h"
+
+#define MAX_QUERY  256
+#define MAX_LEVELS 64
+
+#define SCORE_MATCH          16
+#define SCORE_GAP_START      -3
+#define SCORE_GAP_EXTENSION  -1
+
+#define BONUS_BOUNDARY     8
+#define BONUS_CAMEL_CASE   7
+#define BONUS_CONSECUTIVE  4
+#define BONUS_EXACT_CASE   1
+#define BONUS_FRECENCY_MAX 48
+
+typedef struct {
+	int score;
+	int len;
+	int order;
+	int idx;
+} Fuzzy_Match;
+
+// The entries matching a query that was typed into the current word.
+// Any name that matches a query also matches every prefix of it, so each level only has to search the one below.
+typedef struct {
+	int *matches;
+	int n_matches;
+	int query_len;
+} Filter_Level;
+
+static Filter_Level levels[MAX_LEVELS];
+static int n_levels = 0;
+
+// The query of the deepest level. Every other level's query is a prefix of it.
+static char level_query[MAX_QUERY];
+
+// The listing the levels belong to, which is replaced whenever the directory changes.
+// A listing that was evicted can be read again into the same memory, so its id is checked as well.
+static char *level_names = NULL;
+static int level_n_entries = 0;
+static u32 level_id = 0;
+
+// Finds the first occurrence of a or b in str[start, len), or -1
+static int find_either(char *str, int start, int len, char a, char b) {
+	int i = start;
+
+#if defined(__AVX2__)
+	__m256i a32 = _mm256_set1_epi8(a);
+	__m256i b32 = _mm256_set1_epi8(b);
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((__m256i*)&str[i]);
+		__m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, a32), _mm256_cmpeq_epi8(chunk, b32));
+
+		u32 mask = _mm256_movemask_epi8(eq);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+#if defined(__SSE2__)
+	__m128i a16 = _mm_set1_epi8(a);
+	__m128i b16 = _mm_set1_epi8(b);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((__m128i*)&str[i]);
+		__m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, a16), _mm_cmpeq_epi8(chunk, b16));
+
+		u32 mask = _mm_movemask_epi8(eq);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (str[i] == a || str[i] == b)
+			return i;
+	}
+
+	return -1;
+}
+
+static int bonus_at(char *name, int pos) {
+	if (pos == 0)
+		return BONUS_BOUNDARY;
+
+	u8 prev = name[pos-1];
+	u8 c = name[pos];
+
+	if (prev == '/' || prev == '-' || prev == '_' || prev == '.' || prev == ' ')
+		return BONUS_BOUNDARY;
+	if ((islower(prev) && isupper(c)) || (!isdigit(prev) && isdigit(c)))
+		return BONUS_CAMEL_CASE;
+
+	return 0;
+}
+
+// Returns the position of the last character of the first complete match of the query within the name, or -1 if it doesn't match
+static int find_match_end(char *name, int len, char *lower, char *upper, int query_len) {
+	if (len < query_len)
+		return -1;
+
+	int end = -1;
+	for (int i = 0; i < query_len; i++) {
+		end = find_either(name, end + 1, len, lower[i], upper[i]);
+		if (end < 0)
+			return -1;
+	}
+
+	return end;
+}
+
+// Returns the score of the best match of the query within the name, or -1 if it doesn't match
+static int score_name(char *name, int len, char *query, char *lower, char *upper, int query_len) {
+	int end = find_match_end(name, len, lower, upper, query_len);
+	if (end < 0)
+		return -1;
+
+	// Walk back from the end of the first complete match to find the tightest one that ends there
+	int pos[query_len];
+	int p = end;
+	for (int i = query_len - 1; i >= 0; i--) {
+		while (name[p] != lower[i] && name[p] != upper[i])
+			p--;
+		pos[i] = p--;
+	}
+
+	int score = 0;
+	for (int i = 0; i < query_len; i++) {
+		int bonus = bonus_at(name, pos[i]);
+
+		if (i == 0)
+			bonus *= 2;
+		else if (pos[i] == pos[i-1] + 1)
+			bonus = bonus > BONUS_CONSECUTIVE ? bonus : BONUS_CONSECUTIVE;
+		else
+			score += SCORE_GAP_START + (pos[i] - pos[i-1] - 2) * SCORE_GAP_EXTENSION;
+
+		if (name[pos[i]] == query[i])
+			bonus += BONUS_EXACT_CASE;
+
+		score += SCORE_MATCH + bonus;
+	}
+
+	return score;
+}
+
+typedef struct {
+	Listing *listing;
+	int *candidates;
+	int *matches;
+	int *counts;
+	char *lower;
+	char *upper;
+	int query_len;
+} Filter_Task;
+
+typedef struct {
+	Listing *listing;
+	Filter_Level *level;
+	char *query;
+	char *lower;
+	char *upper;
+	int query_len;
+	u64 listing_key;
+	Fuzzy_Match *heaps;
+	int *heap_sizes;
+	int max_results;
+} Score_Task;
+
+static bool is_worse(Fuzzy_Match *a, Fuzzy_Match *b) {
+	if (a->score != b->score)
+		return a->score < b->score;
+	if (a->len != b->len)
+		return a->len > b->len;
+	return a->order > b->order;
+}
+
+static void sift_down(Fuzzy_Match *heap, int n, int i) {
+	while (true) {
+		int worst = i;
+		int l = 2*i + 1, r = 2*i + 2;
+
+		if (l < n && is_worse(&heap[l], &heap[worst]))
+			worst = l;
+		if (r < n && is_worse(&heap[r], &heap[worst]))
+			worst = r;
+		if (worst == i)
+			break;
+
+		Fuzzy_Match temp = heap[i];
+		heap[i] = heap[worst];
+		heap[worst] = temp;
+		i = worst;
+	}
+}
+
+static void sift_up(Fuzzy_Match *heap, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!is_worse(&heap[i], &heap[parent]))
+			break;
+
+		Fuzzy_Match temp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = temp;
+		i = parent;
+	}
+}
+
+// Keeps the best max_results matches in the heap
+static void add_match(Fuzzy_Match *heap, int *n_heap, int max_results, Fuzzy_Match m) {
+	if (*n_heap < max_results) {
+		heap[*n_heap] = m;
+		sift_up(heap, (*n_heap)++);
+	}
+	else if (is_worse(&heap[0], &m)) {
+		heap[0] = m;
+		sift_down(heap, *n_heap, 0);
+	}
+}
+
+static void clear_levels() {
+	for (int i = 0; i < n_levels; i++)
+		free(levels[i].matches);
+
+	n_levels = 0;
+}
+
+// Each chunk's matches are written over the start of its own part of the matches, since there can't be more of them than candidates
+static void filter_chunk(void *arg, int chunk, int start, int end) {
+	Filter_Task *task = (Filter_Task*)arg;
+	Listing *listing = task->listing;
+
+	// The vectorised search rules out most names before any scoring happens
+	int n = 0;
+	for (int i = start; i < end; i++) {
+		int idx = task->candidates[i];
+		if (find_match_end(ENTRY_NAME(listing, idx), listing->lens[idx], task->lower, task->upper, task->query_len) >= 0)
+			task->matches[start + n++] = idx;
+	}
+
+	task->counts[chunk] = n;
+}
+
+// Gives every entry in the listing that matches the query, in the order of the listing's index.
+// Typing another character only searches the entries that matched before it,
+//  while deleting one goes back to a level that's already been filtered.
+static Filter_Level *filter_listing(Listing *listing, char *query, char *lower, char *upper, int query_len) {
+	if (listing->names != level_names || listing->n_entries != level_n_entries || listing->id != level_id) {
+		clear_levels();
+		level_names = listing->names;
+		level_n_entries = listing->n_entries;
+		level_id = listing->id;
+	}
+
+	while (n_levels > 0) {
+		Filter_Level *top = &levels[n_levels-1];
+		if (top->query_len <= query_len && !memcmp(level_query, query, top->query_len))
+			break;
+
+		free(top->matches);
+		n_levels--;
+	}
+
+	if (n_levels > 0 && levels[n_levels-1].query_len == query_len)
+		return &levels[n_levels-1];
+
+	int *candidates = n_levels > 0 ? levels[n_levels-1].matches : listing->index;
+	int n_candidates = n_levels > 0 ? levels[n_levels-1].n_matches : listing->n_entries;
+
+	int *matches = malloc((n_candidates + 1) * sizeof(int));
+	int n_chunks = (n_candidates + FILTER_CHUNK - 1) / FILTER_CHUNK;
+	int counts[n_chunks + 1];
+
+	Filter_Task task = {
+		.listing = listing,
+		.candidates = candidates,
+		.matches = matches,
+		.counts = counts,
+		.lower = lower,
+		.upper = upper,
+		.query_len = query_len
+	};
+	run_chunks(filter_chunk, &task, n_candidates, FILTER_CHUNK);
+
+	// The chunks' matches are packed together in chunk order, giving the same order as the candidates
+	int n_matches = 0;
+	for (int c = 0; c < n_chunks; c++) {
+		memmove(&matches[n_matches], &matches[c * FILTER_CHUNK], counts[c] * sizeof(int));
+		n_matches += counts[c];
+	}
+
+	// Once the stack is full, the deepest level is replaced
+	if (n_levels == MAX_LEVELS)
+		free(levels[--n_levels].matches);
+
+	levels[n_levels++] = (Filter_Level) {
+		.matches = matches,
+		.n_matches = n_matches,
+		.query_len = query_len
+	};
+	memcpy(level_query, query, query_len);
+
+	return &levels[n_levels-1];
+}
+
+static void score_chunk(void *arg, int chunk, int start, int end) {
+	Score_Task *task = (Score_Task*)arg;
+	Listing *listing = task->listing;
+
+	// A min-heap holding the chunk's best matches so far, with the worst of them at the top
+	Fuzzy_Match *heap = &task->heaps[chunk * task->max_results];
+	int n_heap = 0;
+
+	for (int i = start; i < end; i++) {
+		int idx = task->level->matches[i];
+		char *name = ENTRY_NAME(listing, idx);
+		int len = listing->lens[idx];
+
+		int score = score_name(name, len, task->query, task->lower, task->upper, task->query_len);
+		if (score < 0)
+			continue;
+
+		int frecency = get_frecency(task->listing_key, name);
+		score += frecency < BONUS_FRECENCY_MAX ? frecency : BONUS_FRECENCY_MAX;
+
+		Fuzzy_Match m = {
+			.score = score,
+			.len = len,
+			.order = i,
+			.idx = idx
+		};
+		add_match(heap, &n_heap, task->max_results, m);
+	}
+
+	task->heap_sizes[chunk] = n_heap;
+}
+
+// Writes the listing indices of the best max_results matches into results, best first.
+// Matching ignores case unless the query contains an uppercase letter.
+int fuzzy_search(Listing *listing, char *query, int query_len, int *results, int max_results) {
+	if (query_len <= 0 || max_results <= 0)
+		return 0;
+	if (query_len > MAX_QUERY)
+		query_len = MAX_QUERY;
+
+	bool ignore_case = true;
+	for (int i = 0; i < query_len; i++) {
+		if (isupper((u8)query[i]))
+			ignore_case = false;
+	}
+
+	char lower[query_len], upper[query_len];
+	for (int i = 0; i < query_len; i++) {
+		lower[i] = ignore_case ? tolower((u8)query[i]) : query[i];
+		upper[i] = ignore_case ? toupper((u8)query[i]) : query[i];
+	}
+
+	Filter_Level *level = filter_listing(listing, query, lower, upper, query_len);
+
+	int n_chunks = (level->n_matches + FILTER_CHUNK - 1) / FILTER_CHUNK;
+	Fuzzy_Match *heaps = malloc((n_chunks * max_results + 1) * sizeof(Fuzzy_Match));
+	int heap_sizes[n_chunks + 1];
+
+	Score_Task task = {
+		.listing = listing,
+		.level = level,
+		.query = query,
+		.lower = lower,
+		.upper = upper,
+		.query_len = query_len,
+		.listing_key = get_listing_key(listing),
+		.heaps = heaps,
+		.heap_sizes = heap_sizes,
+		.max_results = max_results
+	};
+	run_chunks(score_chunk, &task, level->n_matches, FILTER_CHUNK);
+
+	// No two matches share an order, so the best of every chunk's best are the same as the best of a single pass
+	Fuzzy_Match heap[max_results];
+	int n_heap = 0;
+
+	for (int c = 0; c < n_chunks; c++) {
+		for (int i = 0; i < heap_sizes[c]; i++)
+			add_match(heap, &n_heap, max_results, heaps[c * max_results + i]);
+	}
+
+	free(heaps);
+
+	// Pop the worst match into the last free spot until the heap is empty, leaving the best match first
+	int n_results = n_heap;
+	while (n_heap > 0) {
+		results[--n_heap] = heap[0].idx;
+		heap[0] = heap[n_heap];
+		sift_down(heap, n_heap, 0);
+	}
+
+	return n_results;
+}
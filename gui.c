@@ -1,5 +1,7 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "pistachio.h"
 
@@ -161,22 +163,26 @@ void draw_string(char *text, int length, int offset, int *cursor, int x, int y,
 		XDrawLine(display, draw_ctx->window, draw_ctx->gc, x, caret_y1, x, caret_y2);
 }
 
+int count_menu_rows(Draw_Info *draw_ctx, Glyph *renders, int y) {
+	return (draw_ctx->window_h - BORDER_PX - y) / FONT_HEIGHT(renders[RES_OFFSET]) + 1;
+}
+
 void draw_menu(Menu_View *view, Listing *list, Settings *config, Glyph *renders, Draw_Info *draw_ctx, int y) {
 	int results_font_h = FONT_HEIGHT(renders[RES_OFFSET]);
 	int sel_offset = results_font_h * BELOW_CURSOR_RATIO;
 
-	view->visible = (draw_ctx->window_h - BORDER_PX - y) / results_font_h + 1;
+	view->visible = count_menu_rows(draw_ctx, renders, y);
 
 	for (int i = view->top; i < view->top + view->visible && i < view->n_items; i++) {
 		int idx = view->menu[i];
-		char *entry = list->table[idx];
-		int len = strlen(entry);
+		char *entry = ENTRY_NAME(list, idx);
+		int len = list->lens[idx];
 
 		int offset = 0;
-		int type = list->stats[idx].st_mode & S_IFMT;
-		if (type == S_IFDIR)
+		int type = list->types[idx];
+		if (type == DT_DIR)
 			offset = 2 * N_CHARS;
-		if (type == S_IFLNK)
+		if (type == DT_LNK)
 			offset += N_CHARS;
 
 		if (i == view->selected) {
@@ -196,6 +202,192 @@ void draw_menu(Menu_View *view, Listing *list, Settings *config, Glyph *renders,
 	}
 }
 
+// Moves the entries that have been launched most often and most recently to the front of the menu,
+//  leaving everything else in its original order.
+void rank_menu(Menu_View *view, Listing *listing) {
+	u64 listing_key = get_listing_key(listing);
+
+	int scores[view->n_items];
+	int n_ranked = 0;
+
+	for (int i = 0; i < view->n_items; i++) {
+		scores[i] = get_frecency(listing_key, ENTRY_NAME(listing, view->menu[i]));
+		n_ranked += scores[i] > 0;
+	}
+
+	if (!n_ranked)
+		return;
+
+	int ranked[n_ranked];
+	int rest[view->n_items - n_ranked + 1];
+	int r = 0, n_rest = 0;
+
+	for (int i = 0; i < view->n_items; i++) {
+		if (!scores[i]) {
+			rest[n_rest++] = view->menu[i];
+			continue;
+		}
+
+		// insertion sort, since only a handful of entries will have been launched before
+		int j = r++;
+		while (j > 0 && scores[ranked[j-1]] < scores[i]) {
+			ranked[j] = ranked[j-1];
+			j--;
+		}
+		ranked[j] = i;
+	}
+
+	for (int i = 0; i < n_ranked; i++)
+		ranked[i] = view->menu[ranked[i]];
+
+	memcpy(view->menu, ranked, n_ranked * sizeof(int));
+	memcpy(&view->menu[n_ranked], rest, n_rest * sizeof(int));
+}
+
+// Fills the menu with the entries in the listing that match the current search.
+// Returns whether the menu should be shown.
+bool build_menu(Menu_View *view, int *menu, Listing *listing, Settings *config, bool is_command, char *word, int word_len, int trailing) {
+	view->n_items = 0;
+	bool show_menu = listing->n_entries && !(is_command && trailing == 0);
+
+	if (trailing == 0 && listing->n_entries > 0) {
+		view->menu = listing->index;
+		view->n_items = listing->n_entries;
+	}
+	else {
+		view->menu = menu;
+		if (show_menu) {
+			// Globs and regular expressions are matched the same way in either search mode
+			char pattern[trailing + 1];
+			int pattern_len = get_pattern_term(word, word_len, trailing, pattern);
+
+			if (get_pattern_type(pattern, pattern_len) != PATTERN_NONE) {
+				view->n_items = filter_by_pattern(listing, pattern, pattern_len, view->menu, MENU_SIZE);
+				rank_menu(view, listing);
+				return show_menu;
+			}
+
+			char term[trailing + 1];
+			int term_len = get_search_term(word, word_len, trailing, term);
+
+			if (config->search_mode == SEARCH_FUZZY) {
+				int max_items = view->visible < MENU_SIZE ? view->visible : MENU_SIZE;
+				view->n_items = fuzzy_search(listing, term, term_len, view->menu, max_items);
+				return show_menu;
+			}
+
+			int lo, hi;
+			int *sorted = find_prefix_range(listing, term, term_len, &lo, &hi);
+
+			// Directories go first, as they do in the listing's index
+			for (int pass = 0; pass < 2; pass++) {
+				for (int i = lo; i < hi && view->n_items < MENU_SIZE; i++) {
+					int idx = sorted[i];
+					bool is_dir = listing->types[idx] == DT_DIR;
+					if (is_dir == (pass == 0))
+						view->menu[view->n_items++] = idx;
+				}
+			}
+
+			rank_menu(view, listing);
+		}
+	}
+
+	return show_menu;
+}
+
+// Selects the menu item with the given name, if it's still there, and scrolls just far enough to show it
+static void keep_selection(Menu_View *view, Listing *listing, char *name) {
+	for (int i = 0; i < view->n_items; i++) {
+		if (strcmp(ENTRY_NAME(listing, view->menu[i]), name))
+			continue;
+
+		view->selected = i;
+		if (view->selected < view->top)
+			view->top = view->selected;
+		if (view->selected > view->top + view->visible-1)
+			view->top = view->selected - (view->visible-1);
+		return;
+	}
+}
+
+void draw_frame(char *textbox, int cursor, bool show_menu, Menu_View *view, Listing *listing, Settings *config, Glyph *renders, Draw_Info *draw_ctx) {
+	XClearArea(display, draw_ctx->window, 0, 0, draw_ctx->window_w, draw_ctx->window_h, false);
+
+	int search_font_h = FONT_HEIGHT(renders[BAR_OFFSET]);
+	int gap = search_font_h * VERT_GAP_RATIO;
+
+	int max_chars = (draw_ctx->window_w - BORDER_PX) / FONT_WIDTH(renders[BAR_OFFSET]);
+	int offset = (cursor >= max_chars) ? cursor - (max_chars-1) : 0;
+
+	draw_string(textbox, -1, offset, &cursor, BORDER_PX, gap, draw_ctx, &renders[BAR_OFFSET]);
+
+	if (show_menu)
+		draw_menu(view, listing, config, renders, draw_ctx, gap * 2);
+}
+
+// A search term starting with "**" searches every directory below the current one.
+// If the word has one, the listing is replaced with the results found so far.
+bool update_search(Listing *listing, char *word, int word_len, int trailing) {
+	if (!listing->path || listing->pending || trailing < 2 || word[word_len - trailing] != '*' || word[word_len - trailing + 1] != '*') {
+		stop_search();
+		return false;
+	}
+
+	char term[trailing + 1];
+	int term_len = get_search_term(word, word_len, trailing, term);
+
+	search_tree(listing->path, &term[2], term_len - 2, listing);
+	return true;
+}
+
+// Set whenever the window takes a new listing, since only then has it let go of the one it held before
+static bool listing_taken = false;
+
+static bool take_listing(char *textbox, int cursor, char **word, int *word_len, int *trailing, Listing *listing) {
+	listing_taken = true;
+	return enumerate_directory(textbox, cursor, word, word_len, trailing, listing);
+}
+
+// Waits for the next X event, while also looking out for changes to any directory that's been listed,
+//  for new results from a recursive search and for listings from slow mounts that are finally ready.
+// Returns true if any of those happened before an X event arrived.
+bool wait_for_event(XEvent *event) {
+	// Events that don't change the menu leave the window holding the same listing, which mustn't be freed underneath it
+	if (listing_taken) {
+		trim_listings();
+		listing_taken = false;
+	}
+
+	int watch_fd = get_directory_watch();
+	int search_fd = get_search_notify_fd();
+	int listing_fd = get_listing_notify_fd();
+
+	while ((watch_fd >= 0 || search_fd >= 0 || listing_fd >= 0) && !XPending(display)) {
+		struct pollfd fds[] = {
+			{ .fd = ConnectionNumber(display), .events = POLLIN },
+			{ .fd = watch_fd, .events = POLLIN },
+			{ .fd = search_fd, .events = POLLIN },
+			{ .fd = listing_fd, .events = POLLIN }
+		};
+		poll(fds, 4, -1);
+
+		u64 count;
+		if ((fds[2].revents & POLLIN) && read(search_fd, &count, sizeof(u64)) > 0)
+			return true;
+
+		if ((fds[3].revents & POLLIN) && read(listing_fd, &count, sizeof(u64)) > 0)
+			return true;
+
+		// Changed listings are read again by the workers, which signal the listing fd once they're done
+		if (fds[1].revents & POLLIN)
+			update_listings();
+	}
+
+	XNextEvent(display, event);
+	return false;
+}
+
 int run_gui(Settings *config, Screen_Info *screen_info, Glyph *renders, char *textbox, int textbox_len, char *error_msg) {
 	if (error_msg) {
 		XSync(display, true);
@@ -238,7 +430,8 @@ int run_gui(Settings *config, Screen_Info *screen_info, Glyph *renders, char *te
 		.menu = menu,
 		.n_items = 0,
 		.selected = -1,
-		.top = 0
+		.top = 0,
+		.visible = count_menu_rows(&draw_ctx, renders, FONT_HEIGHT(renders[BAR_OFFSET]) * VERT_GAP_RATIO * 2)
 	};
 
 	Listing listing;
@@ -251,7 +444,34 @@ int run_gui(Settings *config, Screen_Info *screen_info, Glyph *renders, char *te
 
 	while (!done) {
 		XEvent event;
-		XNextEvent(display, &event);
+		if (wait_for_event(&event)) {
+			// The listing may have been read again or grown since the menu was built,
+			//  so the selection follows the name that was selected rather than its position
+			char *selected_name = NULL;
+			if (view.selected >= 0 && listing.n_entries > 0)
+				selected_name = strdup(ENTRY_NAME(&listing, view.menu[view.selected]));
+
+			char *word = NULL;
+			int word_len = 0;
+			int trailing = 0;
+			memset(&listing, 0, sizeof(Listing));
+			bool is_command = take_listing(textbox, cursor, &word, &word_len, &trailing, &listing);
+			bool is_search = !is_command && update_search(&listing, word, word_len, trailing);
+
+			// Search results are shown as they were found, rather than being filtered again
+			bool show_menu = build_menu(&view, menu, &listing, config, is_command, word, word_len, is_search ? 0 : trailing);
+			if (selected_name) {
+				keep_selection(&view, &listing, selected_name);
+				free(selected_name);
+			}
+			if (view.selected >= view.n_items)
+				view.selected = view.n_items - 1;
+			if (view.top > view.selected)
+				view.top = view.selected > 0 ? view.selected : 0;
+
+			draw_frame(textbox, cursor, show_menu, &view, &listing, config, renders, &draw_ctx);
+			continue;
+		}
 
 		switch (event.type) {
 			case Expose:
@@ -407,20 +627,27 @@ int run_gui(Settings *config, Screen_Info *screen_info, Glyph *renders, char *te
 				int word_len = 0;
 				int trailing = 0;
 				memset(&listing, 0, sizeof(Listing));
-				bool is_command = enumerate_directory(textbox, cursor, &word, &word_len, &trailing, &listing);
+				bool is_command = take_listing(textbox, cursor, &word, &word_len, &trailing, &listing);
+				bool is_search = !is_command && update_search(&listing, word, word_len, trailing);
 
 				char *match = NULL;
 				int match_len = 0;
 
-				if (key == XK_Tab && view.selected < 0) {
+				if (key == XK_Tab && view.selected < 0 && !is_search) {
 					match = find_completeable_span(&listing, word, word_len, trailing, &match_len);
 				}
 				else if (view.selected >= 0 && (key == XK_Tab || key == XK_Right || key == XK_Return) && listing.n_entries > 0) {
-					match = listing.table[view.menu[view.selected]];
-					match_len = strlen(match);
+					match = ENTRY_NAME(&listing, view.menu[view.selected]);
+					match_len = listing.lens[view.menu[view.selected]];
 				}
 
 				if (match) {
+					// The match replaces the search term outright, since a fuzzy match needn't start with it,
+					//  and a match that ignored case needn't be cased the same way
+					memmove(&word[word_len - trailing], &word[word_len], strlen(&word[word_len]) + 1);
+					word_len -= trailing;
+					trailing = 0;
+
 					bool folder_completion = view.n_items == 1 || view.selected >= 0;
 					trailing = complete(word, &word_len, match, match_len, trailing, folder_completion);
 
@@ -430,50 +657,31 @@ int run_gui(Settings *config, Screen_Info *screen_info, Glyph *renders, char *te
 						break;
 					}
 
-					if (!trailing)
-						enumerate_directory(textbox, cursor, &word, &word_len, NULL, &listing);
+					// A search result can be several directories deep, so its own directory is listed in place of the results
+					if (!trailing || is_search) {
+						take_listing(textbox, cursor, &word, &word_len, NULL, &listing);
+						is_search = false;
+						stop_search();
+					}
 
 					cursor = &word[word_len] - textbox;
 					view.selected = -1;
 					view.top = 0;
 				}
 
-				view.n_items = 0;
-				bool show_menu = listing.n_entries && !(is_command && trailing == 0);
-
-				if (trailing == 0 && listing.n_entries > 0) {
-					view.menu = listing.index;
-					view.n_items = listing.n_entries;
-				}
-				else {
-					view.menu = menu;
-					if (show_menu) {
-						for (int i = 0; i < listing.n_entries && view.n_items < MENU_SIZE; i++) {
-							int idx = listing.index[i];
-							if (!difference_ignoring_backslashes(listing.table[idx], word, word_len, trailing))
-								view.menu[view.n_items++] = idx;
-						}
-					}
-				}
-
-				XClearArea(display, draw_ctx.window, 0, 0, draw_ctx.window_w, draw_ctx.window_h, false);
+				bool show_menu = build_menu(&view, menu, &listing, config, is_command, word, word_len, is_search ? 0 : trailing);
+				draw_frame(textbox, cursor, show_menu, &view, &listing, config, renders, &draw_ctx);
 
-				int search_font_h = FONT_HEIGHT(renders[BAR_OFFSET]);
-				int gap = search_font_h * VERT_GAP_RATIO;
-
-				int max_chars = (draw_ctx.window_w - BORDER_PX) / FONT_WIDTH(renders[BAR_OFFSET]);
-				int offset = (cursor >= max_chars) ? cursor - (max_chars-1) : 0;
-
-				draw_string(textbox, -1, offset, &cursor, BORDER_PX, gap, &draw_ctx, &renders[BAR_OFFSET]);
-
-				if (show_menu)
-					draw_menu(&view, &listing, config, renders, &draw_ctx, gap * 2);
+				if (show_menu && !is_command && !is_search)
+					prefetch_subdirectories(&listing, view.menu, view.n_items);
 
 				break;
 			}
 		}
 	}
 
+	stop_search();
+
 	XFreeGC(display, draw_ctx.gc);
 	XDestroyWindow(display, draw_ctx.window);
 
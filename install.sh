@@ -21,8 +21,8 @@ if [ -f /usr/bin/fc-match ]; then
 	FONT=`fc-match monospace -f "%{file}"`
 fi
 
-FLAGS="-O3 -Wall"
-SOURCES="arena.c config.c directory.c font.c gui.c main.c utils.c"
+FLAGS="-O3 -Wall -pthread"
+SOURCES="applications.c arena.c cache.c commands.c config.c directory.c font.c frecency.c fuzzy.c gui.c main.c metadata.c mounts.c pattern.c pool.c search.c utils.c"
 
 echo "Compiliing..."
 gcc ${FLAGS} -DFONT_PATH=\"$FONT\" ${SOURCES} -I/usr/include/freetype2 -lX11 -lfreetype -o pistachio
@@ -1,3 +1,5 @@
+#include <errno.h>
+
 #include "pistachio.h"
 
 #define TEXTBOX_LEN    400
@@ -42,7 +44,44 @@ bool render_glyphs(Glyph *renders, Screen_Info *dimensions, Settings *config) {
 	);
 }
 
-char *parse_command(char *textbox, Settings *config, char *error, int error_len) {
+u64 get_path_key(char *path) {
+	int len = strlen(path);
+	while (len > 1 && path[len-1] == '/')
+		len--;
+
+	return frecency_key(0, path, len);
+}
+
+// Writes 'str' as a single-quoted shell word, so that no quote, '$' or backtick in it is taken by the shell.
+// Returns false if it doesn't fit in 'size' bytes.
+static bool quote_word(char *dst, int size, char *str) {
+	if (size < 3)
+		return false;
+
+	int n = 0;
+	dst[n++] = '\'';
+
+	for (int i = 0; str[i]; i++) {
+		// Leave room for the longest escape, the closing quote and the terminator
+		if (n + 6 > size)
+			return false;
+
+		// A single quote can't appear within single quotes, so it's closed, escaped and opened again
+		if (str[i] == '\'') {
+			memcpy(&dst[n], "'\\''", 4);
+			n += 4;
+		}
+		else
+			dst[n++] = str[i];
+	}
+
+	dst[n++] = '\'';
+	dst[n] = 0;
+	return true;
+}
+
+// On success, 'key' is set to the frecency key of the program or path being launched
+char *parse_command(char *textbox, Settings *config, char *error, int error_len, u64 *key) {
 	int len = strlen(textbox);
 	int second = find_next_word(textbox, 0, len);
 	bool is_command =
@@ -56,10 +95,56 @@ char *parse_command(char *textbox, Settings *config, char *error, int error_len)
 		memcpy(name, textbox, name_len);
 		name[name_len] = 0;
 
+		*key = frecency_key(0, name, name_len);
+
 		char *msg;
-		if (!find_program(name, &msg)) {
+		Application *app = NULL;
+		bool is_program = find_program(name, &msg);
+
+		// Applications are listed under the names in their .desktop files, which can have spaces in them
+		if (!is_program) {
+			char app_name[name_len + 1];
+			memcpy(app_name, name, name_len + 1);
+			remove_backslashes(app_name, -1);
+
+			app = find_application(app_name);
+			if (app)
+				*key = frecency_key(0, app_name, -1);
+		}
+
+		if (app) {
+			char *args = second ? &textbox[second] : "";
+			char *sep = *args ? " " : "";
+
+			// Leave room for the terminal and the trailing " &"
+			int room = TEXTBOX_LEN - 3;
+			if (app->terminal && config->terminal_program.command)
+				room -= strlen(config->terminal_program.command) + 1;
+
+			char cmd[TEXTBOX_LEN];
+			if (room <= 0 || snprintf(cmd, room, "%s%s%s", app->exec, sep, args) >= room) {
+				snprintf(error, error_len, "command too long: \"%s\"", app->name);
+				return NULL;
+			}
+
+			// The terminal is handed the whole command as one word, which its own shell splits up again
+			if (app->terminal) {
+				char quoted[TEXTBOX_LEN];
+				if (!quote_word(quoted, room - 3, cmd)) {
+					snprintf(error, error_len, "command too long: \"%s\"", app->name);
+					return NULL;
+				}
+				snprintf(cmd, room, "-e %s", quoted);
+			}
+
+			strcpy(textbox, cmd);
+			if (app->terminal)
+				prepend_word(config->terminal_program.command, textbox);
+		}
+		else if (!is_program) {
 			bool is_exe = false;
 			char *path = get_desugared_path(textbox, name_len);
+			*key = get_path_key(path);
 			FILE *f = fopen(path, "rb");
 			if (f) {
 				char magic[4];
@@ -74,7 +159,7 @@ char *parse_command(char *textbox, Settings *config, char *error, int error_len)
 			}
 		}
 
-		if (name_len == 4 && (!memcmp(name, "sudo", 4) || !memcmp(name, "doas", 4))) {
+		if (!app && name_len == 4 && (!memcmp(name, "sudo", 4) || !memcmp(name, "doas", 4))) {
 			// kind of risky!
 			// FIXME: pass in textbox size so that this can be done safely
 			textbox[len] = '"';
@@ -92,11 +177,13 @@ char *parse_command(char *textbox, Settings *config, char *error, int error_len)
 	else {
 		struct stat s;
 		char *path = get_desugared_path(textbox, len);
-		if (stat(path, &s) != 0) {
-			snprintf(error, error_len, "file/folder not found: %s", textbox);
+		if (!stat_within(path, &s, IO_DEADLINE_MS)) {
+			snprintf(error, error_len, errno == ETIMEDOUT ? "file/folder not responding: %s" : "file/folder not found: %s", textbox);
 			return NULL;
 		}
 
+		*key = get_path_key(path);
+
 		// If this is a folder
 		if ((s.st_mode & S_IFMT) == S_IFDIR) {
 			prepend_word(config->folder_program.command, textbox);
@@ -164,7 +251,14 @@ char *parse_command(char *textbox, Settings *config, char *error, int error_len)
 int main(int argc, char **argv) {
 	defer_arena_destruction();
 	init_directory_arena();
+	open_frecency();
+
+	start_workers();
+	scan_path_directories();
+	scan_applications();
+
 	Settings *config = load_config();
+	set_listing_budget((u64)config->listing_memory * 1024 * 1024);
 
 	struct stat s = {0};
 	if (stat(config->font_path, &s) != 0 || (s.st_mode & S_IFREG) == 0) {
@@ -195,19 +289,26 @@ int main(int argc, char **argv) {
 	char error_buf[ERROR_MSG_LEN] = {0};
 	char *error_msg = NULL;
 	char *command = NULL;
+	u64 key = 0;
 
 	while (!command) {
 		int res = run_gui(config, &dimensions, renders, textbox, TEXTBOX_LEN, error_msg);
 		if (res == STATUS_EXIT)
 			break;
 
-		command = parse_command(textbox, config, error_buf, ERROR_MSG_LEN);
+		command = parse_command(textbox, config, error_buf, ERROR_MSG_LEN, &key);
 		error_msg = &error_buf[0];
 	}
 
+	if (command)
+		record_launch(key);
+
 	close_display();
 	free(renders);
 
+	stop_workers();
+	save_directory_cache();
+
 	if (command)
 		system(command);
 
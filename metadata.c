@@ -0,0 +1,281 @@
+// Fetches the types of many directory entries at once, for filesystems that don't report entry types.
+// Requests are queued with io_uring so that the device can work through a batch of them at its own pace,
+//  and when io_uring isn't available, the work is split over the worker pool instead.
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define QUEUE_DEPTH  64
+#define CHUNK_SIZE   256
+
+typedef struct {
+	int fd;
+	u32 *sq_head;
+	u32 *sq_tail;
+	u32 *sq_mask;
+	u32 *sq_array;
+	u32 *cq_head;
+	u32 *cq_tail;
+	u32 *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct statx *results;
+	char *rings;
+	int rings_size;
+	int sqes_size;
+} Ring;
+
+typedef struct {
+	int dir_fd;
+	char *names;
+	u32 *offsets;
+	int *which;
+	u8 *types;
+} Stat_Task;
+
+// Each thread gets its own ring, since only one thread may submit to a ring at a time
+static __thread Ring ring = {0};
+static __thread bool ring_tried = false;
+
+// Set once io_uring has failed, so that no other thread tries it again
+static bool ring_unavailable = false;
+
+// Closes each thread's ring when the thread exits, since directories on slow mounts are read on threads of their own
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void close_thread_ring(void *unused);
+
+static void make_ring_key() {
+	pthread_key_create(&ring_key, close_thread_ring);
+}
+
+static bool open_ring() {
+	if (ring_tried)
+		return ring.results && ring.fd >= 0;
+
+	ring_tried = true;
+	if (__atomic_load_n(&ring_unavailable, __ATOMIC_RELAXED))
+		return false;
+
+	struct io_uring_params p = {0};
+	int fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &p);
+	if (fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		if (fd >= 0)
+			close(fd);
+
+		__atomic_store_n(&ring_unavailable, true, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	int sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	int cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	int ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+	char *rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	// The kernel may still write to these after a failed submission, so they outlive any one batch
+	struct statx *results = malloc(QUEUE_DEPTH * sizeof(struct statx));
+
+	if (sqes == MAP_FAILED || !results) {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+
+		free(results);
+		munmap(rings, ring_size);
+		close(fd);
+		return false;
+	}
+
+	ring = (Ring) {
+		.fd = fd,
+		.sq_head = (u32*)&rings[p.sq_off.head],
+		.sq_tail = (u32*)&rings[p.sq_off.tail],
+		.sq_mask = (u32*)&rings[p.sq_off.ring_mask],
+		.sq_array = (u32*)&rings[p.sq_off.array],
+		.cq_head = (u32*)&rings[p.cq_off.head],
+		.cq_tail = (u32*)&rings[p.cq_off.tail],
+		.cq_mask = (u32*)&rings[p.cq_off.ring_mask],
+		.sqes = sqes,
+		.cqes = (struct io_uring_cqe*)&rings[p.cq_off.cqes],
+		.results = results,
+		.rings = rings,
+		.rings_size = ring_size,
+		.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe)
+	};
+
+	pthread_once(&ring_key_once, make_ring_key);
+	pthread_setspecific(ring_key, &ring);
+	return true;
+}
+
+// Lets go of the calling thread's ring once it's failed, after waiting for the requests that were already submitted.
+// The kernel may still write into the statx buffers until each of those has completed, so if they can't be waited for,
+//  the buffers are left behind rather than freed. That happens at most once, since no thread uses a ring after one has failed.
+static void close_ring(int in_flight) {
+	while (in_flight > 0) {
+		u32 head = *ring.cq_head;
+		u32 cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		in_flight -= cq_tail - head;
+		__atomic_store_n(ring.cq_head, cq_tail, __ATOMIC_RELEASE);
+
+		if (in_flight > 0 && syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			break;
+	}
+
+	// The kernel keeps the rings for itself for as long as it needs them, so they can go right away
+	munmap(ring.sqes, ring.sqes_size);
+	munmap(ring.rings, ring.rings_size);
+	close(ring.fd);
+
+	if (in_flight <= 0)
+		free(ring.results);
+
+	ring = (Ring) { .fd = -1 };
+	pthread_setspecific(ring_key, NULL);
+}
+
+// Every request has completed by the time fetch_entry_types() returns, so there's nothing left to wait for
+static void close_thread_ring(void *unused) {
+	if (ring.fd >= 0 && ring.results)
+		close_ring(0);
+}
+
+static u8 stat_type(int dir_fd, char *name) {
+	struct stat s;
+	if (fstatat(dir_fd, name, &s, AT_SYMLINK_NOFOLLOW) != 0)
+		return DT_UNKNOWN;
+
+	return IFTODT(s.st_mode);
+}
+
+// Keeps up to QUEUE_DEPTH statx requests in flight, topping the queue up as requests complete.
+// Returns false if the ring couldn't be used, in which case nothing has been written.
+static bool fetch_types_with_ring(int dir_fd, char *names, u32 *offsets, int *which, int n, u8 *types) {
+	if (!open_ring())
+		return false;
+
+	struct statx *results = ring.results;
+	int free_slots[QUEUE_DEPTH];
+	int n_free = QUEUE_DEPTH;
+	for (int i = 0; i < QUEUE_DEPTH; i++)
+		free_slots[i] = i;
+
+	// Which entry each statx buffer belongs to
+	int owner[QUEUE_DEPTH];
+
+	int next = 0, n_done = 0;
+	int to_submit = 0;
+
+	while (n_done < n) {
+		u32 tail = *ring.sq_tail;
+
+		while (next < n && n_free > 0) {
+			int slot = free_slots[--n_free];
+			owner[slot] = which[next];
+
+			u32 idx = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dir_fd;
+			sqe->addr = (u64)&names[offsets[which[next]]];
+			sqe->len = STATX_TYPE | STATX_MODE;
+			sqe->off = (u64)&results[slot];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data = slot;
+
+			ring.sq_array[idx] = idx;
+			tail++;
+			next++;
+			to_submit++;
+		}
+
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		// Anything left unsubmitted stays in the ring and goes in with the next call
+		int submitted = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted >= 0)
+			to_submit -= submitted;
+
+		if (submitted < 0 && errno != EINTR) {
+			// Requests already in the ring can't be taken back, so this ring is never used again
+			close_ring(next - n_done - to_submit);
+			__atomic_store_n(&ring_unavailable, true, __ATOMIC_RELAXED);
+
+			for (int i = 0; i < n; i++)
+				types[which[i]] = stat_type(dir_fd, &names[offsets[which[i]]]);
+			return true;
+		}
+
+		u32 head = *ring.cq_head;
+		u32 cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != cq_tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			int slot = cqe->user_data;
+			int entry = owner[slot];
+
+			if (cqe->res == 0)
+				types[entry] = IFTODT(results[slot].stx_mode);
+			else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+				types[entry] = stat_type(dir_fd, &names[offsets[entry]]);
+			else
+				types[entry] = DT_UNKNOWN;
+
+			free_slots[n_free++] = slot;
+			n_done++;
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+static void stat_chunk(void *arg, int chunk, int start, int end) {
+	Stat_Task *task = (Stat_Task*)arg;
+
+	for (int i = start; i < end; i++) {
+		int entry = task->which[i];
+		task->types[entry] = stat_type(task->dir_fd, &task->names[task->offsets[entry]]);
+	}
+}
+
+static void fetch_types_with_pool(int dir_fd, char *names, u32 *offsets, int *which, int n, u8 *types) {
+	Stat_Task task = {
+		.dir_fd = dir_fd,
+		.names = names,
+		.offsets = offsets,
+		.which = which,
+		.types = types
+	};
+	run_chunks(stat_chunk, &task, n, CHUNK_SIZE);
+}
+
+// Writes the type of each entry listed in 'which' into the matching spot in 'types', or DT_UNKNOWN if it couldn't be found.
+// Names are looked up relative to the directory, so no full paths are built.
+void fetch_entry_types(int dir_fd, char *names, u32 *offsets, int *which, int n, u8 *types) {
+	if (n <= 0)
+		return;
+
+	if (fetch_types_with_ring(dir_fd, names, offsets, which, n, types))
+		return;
+
+	fetch_types_with_pool(dir_fd, names, offsets, which, n, types);
+}
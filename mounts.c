@@ -0,0 +1,366 @@
+// Keeps slow or hung mounts (NFS, sshfs, a stalled FUSE filesystem) from freezing the window.
+// Metadata that the window needs from such a mount is fetched on a separate thread with a deadline, and a mount that keeps
+//  missing its deadlines is remembered, so that later lookups on it don't wait at all.
+// Local filesystems are read directly, since they never take long enough to be worth a thread.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define SLOW_MOUNT_STRIKES  2
+#define MAX_SLOW_MOUNTS     32
+
+typedef struct {
+	char *path;
+	int len;
+	int strikes;
+	bool probing;
+} Slow_Mount;
+
+typedef struct {
+	char *path;
+	int len;
+} Mount_Point;
+
+typedef struct {
+	char *path;
+	struct stat s;
+	int result;
+	int error;
+	bool done;
+	int refs;
+} Stat_Call;
+
+static Slow_Mount mounts[MAX_SLOW_MOUNTS];
+static int n_mounts = 0;
+
+// Mount points of filesystems that can block for as long as a server or a FUSE daemon likes
+static Mount_Point *remote_mounts = NULL;
+static int n_remote_mounts = 0;
+
+// Kept open so that poll() can tell when anything has been mounted or unmounted
+static int mount_table_fd = -1;
+static bool mount_table_read = false;
+
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t call_done = PTHREAD_COND_INITIALIZER;
+
+// Whether 'prefix' is the path of a directory containing 'path', or the path itself
+static bool is_under(char *path, char *prefix, int prefix_len) {
+	if (prefix_len == 1 && prefix[0] == '/')
+		return path[0] == '/';
+
+	return !strncmp(path, prefix, prefix_len) && (path[prefix_len] == '/' || path[prefix_len] == 0);
+}
+
+// Mount points in /proc/self/mounts have their spaces, tabs and newlines written as octal escapes
+static int unescape_mount_point(char *str) {
+	int len = 0;
+	for (int i = 0; str[i]; i++) {
+		if (str[i] == '\\' && str[i+1] >= '0' && str[i+1] <= '7' && str[i+2] && str[i+3]) {
+			str[len++] = (char)((str[i+1] - '0') * 64 + (str[i+2] - '0') * 8 + (str[i+3] - '0'));
+			i += 3;
+		}
+		else
+			str[len++] = str[i];
+	}
+
+	str[len] = 0;
+	return len;
+}
+
+// Splits a line of /proc/self/mounts into its mount point and filesystem type
+static bool parse_mount_line(char *line, char **mount, int *len, char **type) {
+	*mount = strchr(line, ' ');
+	if (!*mount)
+		return false;
+
+	(*mount)++;
+	char *end = strchr(*mount, ' ');
+	if (!end)
+		return false;
+
+	*end = 0;
+	*len = unescape_mount_point(*mount);
+
+	*type = end + 1;
+	end = strchr(*type, ' ');
+	if (!end)
+		return false;
+
+	*end = 0;
+	return true;
+}
+
+// Finds the mount point that 'path' lives under, which is read from procfs since that never blocks on a mount
+static char *find_mount_point(char *path) {
+	FILE *f = fopen("/proc/self/mounts", "r");
+	if (!f)
+		return NULL;
+
+	char *best = NULL;
+	int best_len = -1;
+
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		char *mount, *type;
+		int len;
+		if (!parse_mount_line(line, &mount, &len, &type))
+			continue;
+
+		if (len > best_len && is_under(path, mount, len)) {
+			free(best);
+			best = strdup(mount);
+			best_len = len;
+		}
+	}
+
+	fclose(f);
+	return best;
+}
+
+static bool is_remote_type(char *type) {
+	static char *remote_types[] = {
+		"nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "9p", "afs", "ceph", "glusterfs", "lustre", "davfs", "sshfs"
+	};
+
+	if (!strncmp(type, "fuse", 4))
+		return true;
+
+	for (int i = 0; i < (int)(sizeof(remote_types) / sizeof(char*)); i++) {
+		if (!strcmp(type, remote_types[i]))
+			return true;
+	}
+	return false;
+}
+
+// The mounts lock must be held before calling this.
+// The mount table is only read again once procfs says it's changed, so checking it usually costs a single poll().
+static void update_remote_mounts() {
+	if (mount_table_fd < 0) {
+		mount_table_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+		if (mount_table_fd < 0)
+			return;
+	}
+	else {
+		struct pollfd p = { .fd = mount_table_fd, .events = POLLPRI };
+		if (poll(&p, 1, 0) <= 0 || !(p.revents & (POLLERR | POLLPRI)))
+			return;
+	}
+
+	FILE *f = fopen("/proc/self/mounts", "r");
+	if (!f)
+		return;
+
+	for (int i = 0; i < n_remote_mounts; i++)
+		free(remote_mounts[i].path);
+	n_remote_mounts = 0;
+
+	int cap = 0;
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		char *mount, *type;
+		int len;
+		if (!parse_mount_line(line, &mount, &len, &type) || !is_remote_type(type))
+			continue;
+
+		if (n_remote_mounts >= cap) {
+			cap = cap ? cap * 2 : 8;
+			remote_mounts = realloc(remote_mounts, cap * sizeof(Mount_Point));
+		}
+		remote_mounts[n_remote_mounts++] = (Mount_Point) { strdup(mount), len };
+	}
+
+	fclose(f);
+	mount_table_read = true;
+}
+
+// The mounts lock must be held before calling this.
+// Without a mount table, every path is taken to be on a mount that might hang.
+static bool is_local(char *path) {
+	update_remote_mounts();
+	if (!mount_table_read)
+		return false;
+
+	for (int i = 0; i < n_remote_mounts; i++) {
+		if (is_under(path, remote_mounts[i].path, remote_mounts[i].len))
+			return false;
+	}
+	return true;
+}
+
+// The mounts lock must be held before calling this
+static Slow_Mount *find_slow_mount(char *path) {
+	for (int i = 0; i < n_mounts; i++) {
+		if (is_under(path, mounts[i].path, mounts[i].len))
+			return &mounts[i];
+	}
+	return NULL;
+}
+
+// Tells whether the path can be read directly, or normally but with a deadline.
+// On a slow mount, only one read at a time is let through, which doesn't wait for its result and finds out whether the mount has recovered.
+int check_mount(char *path) {
+	pthread_mutex_lock(&mounts_lock);
+
+	int state = MOUNT_OK;
+	Slow_Mount *m = find_slow_mount(path);
+
+	if (m && m->strikes >= SLOW_MOUNT_STRIKES) {
+		state = m->probing ? MOUNT_BUSY : MOUNT_SLOW;
+		m->probing = true;
+	}
+	else if (!m && is_local(path))
+		state = MOUNT_LOCAL;
+
+	pthread_mutex_unlock(&mounts_lock);
+	return state;
+}
+
+// Called once a read that was let through has finished, with whether it finished within the deadline
+void end_mount_read(char *path, bool on_time) {
+	pthread_mutex_lock(&mounts_lock);
+
+	Slow_Mount *m = find_slow_mount(path);
+	if (m && on_time) {
+		free(m->path);
+		*m = mounts[--n_mounts];
+	}
+	else if (m && m->strikes >= SLOW_MOUNT_STRIKES)
+		m->probing = false;
+
+	pthread_mutex_unlock(&mounts_lock);
+}
+
+// Only mounts that can hang are ever struck, since a local read that's slow will still finish
+void record_timeout(char *path) {
+	pthread_mutex_lock(&mounts_lock);
+	bool local = is_local(path);
+	pthread_mutex_unlock(&mounts_lock);
+
+	if (local)
+		return;
+
+	// Reading the mount table can't block, but it isn't free, so it's done outside the lock
+	char *mount_point = find_mount_point(path);
+	if (!mount_point)
+		return;
+
+	pthread_mutex_lock(&mounts_lock);
+
+	Slow_Mount *m = find_slow_mount(path);
+	if (m)
+		free(mount_point);
+	else if (n_mounts < MAX_SLOW_MOUNTS) {
+		m = &mounts[n_mounts++];
+		*m = (Slow_Mount) {
+			.path = mount_point,
+			.len = strlen(mount_point)
+		};
+	}
+	else
+		free(mount_point);
+
+	if (m)
+		m->strikes++;
+
+	pthread_mutex_unlock(&mounts_lock);
+}
+
+// Gives the time 'ms' milliseconds from now, for pthread_cond_timedwait
+struct timespec get_deadline(int ms) {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (ms % 1000) * 1000000L;
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
+	}
+	return t;
+}
+
+static void release_call(Stat_Call *call) {
+	if (--call->refs == 0) {
+		free(call->path);
+		free(call);
+	}
+}
+
+static void run_stat(void *arg) {
+	Stat_Call *call = (Stat_Call*)arg;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct stat s;
+	int result = stat(call->path, &s);
+	int error = errno;
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+	end_mount_read(call->path, ms <= IO_DEADLINE_MS);
+
+	pthread_mutex_lock(&call_lock);
+	call->s = s;
+	call->result = result;
+	call->error = error;
+	call->done = true;
+	pthread_cond_broadcast(&call_done);
+	release_call(call);
+	pthread_mutex_unlock(&call_lock);
+}
+
+// Like stat(), but gives up after 'timeout_ms', in which case errno is set to ETIMEDOUT.
+// The call itself carries on in the background, so that a mount that comes back can be noticed.
+bool stat_within(char *path, struct stat *s, int timeout_ms) {
+	int state = check_mount(path);
+	if (state == MOUNT_LOCAL)
+		return stat(path, s) == 0;
+
+	if (state == MOUNT_BUSY) {
+		errno = ETIMEDOUT;
+		return false;
+	}
+
+	if (state == MOUNT_SLOW)
+		timeout_ms = 0;
+
+	Stat_Call *call = malloc(sizeof(Stat_Call));
+	*call = (Stat_Call) {
+		.path = strdup(path),
+		.refs = 2
+	};
+
+	run_detached(run_stat, call);
+
+	struct timespec deadline = get_deadline(timeout_ms);
+
+	pthread_mutex_lock(&call_lock);
+	while (!call->done && pthread_cond_timedwait(&call_done, &call_lock, &deadline) != ETIMEDOUT);
+
+	bool done = call->done;
+	bool ok = done && call->result == 0;
+	if (ok)
+		*s = call->s;
+	int error = done ? call->error : ETIMEDOUT;
+
+	release_call(call);
+	pthread_mutex_unlock(&call_lock);
+
+	if (!done && state == MOUNT_OK)
+		record_timeout(path);
+
+	errno = error;
+	return ok;
+}
@@ -0,0 +1,629 @@
+// Glob and regular expression queries.
+// A pattern is parsed into an NFA, which is then turned into a DFA whose states are sets of NFA states,
+//  so that a name is matched with one table lookup per byte and never any backtracking.
+// Bytes that every part of the pattern treats the same way share a column of the table, which keeps it small.
+
+#include <ctype.h>
+
+#include "pistachio.h"
+
+#define MAX_PATTERN     256
+#define MAX_NFA_STATES  1024
+#define MAX_DFA_STATES  256
+
+#define SET_WORDS  (256 / 32)
+#define NFA_WORDS  (MAX_NFA_STATES / 32)
+
+#define NFA_SET    0
+#define NFA_SPLIT  1
+#define NFA_MATCH  2
+
+// Every DFA has a state that can never match, and a state that has matched no matter what comes after
+#define DFA_DEAD      0
+#define DFA_ACCEPTED  1
+
+// Each state's row of the table holds the start of the next state's row for every byte, so a step is one load.
+// The null byte at the end of a name leads to one of the two final states, so names are run without their lengths.
+#define ROW(state)  ((state) * 256)
+#define IS_RUNNING(row)  ((row) > ROW(DFA_ACCEPTED))
+
+// A SET state moves to 'out' on any byte in its set.
+// A SPLIT state moves to 'out' and 'out1' without reading anything, and either may be -1.
+typedef struct {
+	u8 type;
+	int out;
+	int out1;
+	u32 set[SET_WORDS];
+} Nfa_State;
+
+// A piece of the NFA with one way in and one way out, where 'end' is a SPLIT state whose 'out' is yet to be set
+typedef struct {
+	int start;
+	int end;
+} Fragment;
+
+typedef struct {
+	char *src;
+	int pos;
+	int len;
+	bool is_glob;
+	bool ignore_case;
+	bool failed;
+	Nfa_State *states;
+	int n_states;
+	// The run of plain characters at the end of a glob, so far
+	char suffix[MAX_PATTERN];
+	int suffix_len;
+} Parser;
+
+typedef struct {
+	u32 *table;
+	bool *accepting;
+	int n_states;
+	u32 start;
+	bool valid;
+	// What a glob's matches have to end with, which rules most names out without running them
+	char suffix[MAX_PATTERN];
+	int suffix_len;
+	bool ignore_case;
+} Dfa;
+
+typedef struct {
+	Listing *listing;
+	char *suffix_names;
+	int suffix_len;
+	int *matches;
+	int *counts;
+	int n_chunks;
+	int max_results;
+	// The chunk by which the chunks before it have found max_results matches between them
+	int filled_chunk;
+} Pattern_Task;
+
+// The pattern that was compiled last, since the menu and tab completion both ask for the same one
+static Dfa dfa = {0};
+static char dfa_source[MAX_PATTERN];
+static int dfa_source_len = -1;
+static int dfa_type = PATTERN_NONE;
+
+static void add_byte(u32 *set, u8 c) {
+	set[c >> 5] |= 1u << (c & 31);
+}
+
+static bool has_byte(u32 *set, u8 c) {
+	return (set[c >> 5] >> (c & 31)) & 1;
+}
+
+static void add_range(Parser *p, u32 *set, u8 lo, u8 hi) {
+	for (int c = lo; c <= hi; c++) {
+		add_byte(set, c);
+		if (p->ignore_case && isalpha(c))
+			add_byte(set, isupper(c) ? tolower(c) : toupper(c));
+	}
+}
+
+static int add_state(Parser *p, u8 type, int out, int out1) {
+	if (p->n_states >= MAX_NFA_STATES) {
+		p->failed = true;
+		return 0;
+	}
+
+	p->states[p->n_states] = (Nfa_State) {
+		.type = type,
+		.out = out,
+		.out1 = out1
+	};
+	return p->n_states++;
+}
+
+static Fragment make_empty(Parser *p) {
+	int s = add_state(p, NFA_SPLIT, -1, -1);
+	return (Fragment) { s, s };
+}
+
+static Fragment make_set(Parser *p, u32 *set) {
+	int end = add_state(p, NFA_SPLIT, -1, -1);
+	int start = add_state(p, NFA_SET, end, -1);
+	memcpy(p->states[start].set, set, sizeof(p->states[start].set));
+	return (Fragment) { start, end };
+}
+
+// Adds the bytes of a \d, \w or \s class, or the escaped byte itself
+static void add_escape(Parser *p, u32 *set, char c) {
+	u32 class[SET_WORDS] = {0};
+	bool negate = isupper((u8)c);
+
+	switch (tolower((u8)c)) {
+		case 'd':
+			add_range(p, class, '0', '9');
+			break;
+		case 'w':
+			add_range(p, class, 'a', 'z');
+			add_range(p, class, 'A', 'Z');
+			add_range(p, class, '0', '9');
+			add_byte(class, '_');
+			break;
+		case 's':
+			add_byte(class, ' ');
+			add_byte(class, '\t');
+			break;
+		default:
+			add_range(p, set, c, c);
+			return;
+	}
+
+	for (int i = 0; i < SET_WORDS; i++)
+		set[i] |= negate ? ~class[i] : class[i];
+}
+
+// Parses a bracket expression, once its '[' has been read.
+// A ']' straight after the opening bracket is taken as a member, as is a '-' at either end.
+static Fragment parse_class(Parser *p) {
+	u32 set[SET_WORDS] = {0};
+
+	bool negate = false;
+	if (p->pos < p->len && (p->src[p->pos] == '^' || (p->is_glob && p->src[p->pos] == '!'))) {
+		negate = true;
+		p->pos++;
+	}
+
+	bool first = true;
+	while (p->pos < p->len && (first || p->src[p->pos] != ']')) {
+		first = false;
+		u8 c = p->src[p->pos++];
+
+		if (c == '\\' && p->pos < p->len) {
+			c = p->src[p->pos++];
+			if (!p->is_glob && strchr("dwsDWS", c)) {
+				add_escape(p, set, c);
+				continue;
+			}
+		}
+
+		if (p->pos + 1 < p->len && p->src[p->pos] == '-' && p->src[p->pos + 1] != ']') {
+			u8 hi = p->src[p->pos + 1];
+			p->pos += 2;
+			if (hi >= c)
+				add_range(p, set, c, hi);
+		}
+		else
+			add_range(p, set, c, c);
+	}
+
+	// An unfinished class matches nothing until its ']' is typed
+	if (p->pos >= p->len) {
+		p->failed = true;
+		return make_empty(p);
+	}
+	p->pos++;
+
+	if (negate) {
+		for (int i = 0; i < SET_WORDS; i++)
+			set[i] = ~set[i];
+	}
+
+	return make_set(p, set);
+}
+
+static Fragment parse_alternation(Parser *p);
+
+static Fragment parse_atom(Parser *p) {
+	u32 set[SET_WORDS] = {0};
+	char c = p->src[p->pos++];
+
+	int suffix_len = p->suffix_len;
+	p->suffix_len = 0;
+
+	if (c == '[')
+		return parse_class(p);
+
+	if (c == '\\' && p->pos < p->len) {
+		c = p->src[p->pos++];
+		if (p->is_glob) {
+			add_range(p, set, c, c);
+			p->suffix[suffix_len] = c;
+			p->suffix_len = suffix_len + 1;
+		}
+		else
+			add_escape(p, set, c);
+
+		return make_set(p, set);
+	}
+
+	if (p->is_glob && c == '*') {
+		memset(set, 0xff, sizeof(set));
+		Fragment any = make_set(p, set);
+
+		int end = add_state(p, NFA_SPLIT, -1, -1);
+		int split = add_state(p, NFA_SPLIT, any.start, end);
+		p->states[any.end].out = split;
+		return (Fragment) { split, end };
+	}
+
+	if ((p->is_glob && c == '?') || (!p->is_glob && c == '.')) {
+		memset(set, 0xff, sizeof(set));
+		return make_set(p, set);
+	}
+
+	if (!p->is_glob && c == '(') {
+		Fragment f = parse_alternation(p);
+		if (p->pos >= p->len || p->src[p->pos] != ')')
+			p->failed = true;
+
+		p->pos++;
+		return f;
+	}
+
+	if (p->is_glob) {
+		p->suffix[suffix_len] = c;
+		p->suffix_len = suffix_len + 1;
+	}
+
+	add_range(p, set, c, c);
+	return make_set(p, set);
+}
+
+static Fragment parse_repetition(Parser *p) {
+	Fragment f = parse_atom(p);
+
+	while (!p->is_glob && p->pos < p->len && !p->failed) {
+		char op = p->src[p->pos];
+		if (op != '*' && op != '+' && op != '?')
+			break;
+
+		p->pos++;
+		int end = add_state(p, NFA_SPLIT, -1, -1);
+		int split = add_state(p, NFA_SPLIT, f.start, end);
+
+		if (op == '?')
+			p->states[f.end].out = end;
+		else
+			p->states[f.end].out = split;
+
+		f = (Fragment) { op == '+' ? f.start : split, end };
+	}
+
+	return f;
+}
+
+static Fragment parse_sequence(Parser *p) {
+	Fragment f = make_empty(p);
+
+	while (p->pos < p->len && !p->failed) {
+		char c = p->src[p->pos];
+		if (!p->is_glob && (c == '|' || c == ')'))
+			break;
+
+		Fragment next = parse_repetition(p);
+		p->states[f.end].out = next.start;
+		f.end = next.end;
+	}
+
+	return f;
+}
+
+static Fragment parse_alternation(Parser *p) {
+	Fragment f = parse_sequence(p);
+
+	while (!p->is_glob && p->pos < p->len && p->src[p->pos] == '|' && !p->failed) {
+		p->pos++;
+		Fragment g = parse_sequence(p);
+
+		int end = add_state(p, NFA_SPLIT, -1, -1);
+		int start = add_state(p, NFA_SPLIT, f.start, g.start);
+		p->states[f.end].out = end;
+		p->states[g.end].out = end;
+		f = (Fragment) { start, end };
+	}
+
+	return f;
+}
+
+// Adds every state that can be reached from 's' without reading a byte.
+// Only SET and MATCH states are kept in the result, since they're all a DFA state needs to know.
+static void add_closure(Nfa_State *states, int s, u32 *set, u32 *seen, int *stack) {
+	int n = 0;
+	stack[n++] = s;
+
+	while (n > 0) {
+		s = stack[--n];
+		if (s < 0 || (seen[s >> 5] >> (s & 31)) & 1)
+			continue;
+
+		seen[s >> 5] |= 1u << (s & 31);
+
+		if (states[s].type == NFA_SPLIT) {
+			stack[n++] = states[s].out;
+			stack[n++] = states[s].out1;
+		}
+		else
+			set[s >> 5] |= 1u << (s & 31);
+	}
+}
+
+// Splits the bytes into classes, where every byte in a class is in exactly the same SET states
+static int make_byte_classes(Nfa_State *states, int n_states, u8 *classes) {
+	memset(classes, 0, 256);
+	int n_classes = 1;
+
+	for (int s = 0; s < n_states; s++) {
+		if (states[s].type != NFA_SET)
+			continue;
+
+		int remap[2][256];
+		memset(remap, 0xff, sizeof(remap));
+		n_classes = 0;
+
+		for (int b = 0; b < 256; b++) {
+			int *slot = &remap[has_byte(states[s].set, b)][classes[b]];
+			if (*slot < 0)
+				*slot = n_classes++;
+
+			classes[b] = *slot;
+		}
+	}
+
+	return n_classes;
+}
+
+static bool has_match(Nfa_State *states, int n_states, u32 *set) {
+	for (int s = 0; s < n_states; s++) {
+		if ((set[s >> 5] >> (s & 31)) & 1 && states[s].type == NFA_MATCH)
+			return true;
+	}
+	return false;
+}
+
+// Turns the NFA into a DFA by following every set of states it can be in at once.
+// Unless the pattern has to reach the end of the name, any set that holds the match state becomes DFA_ACCEPTED.
+static bool build_dfa(Nfa_State *states, int n_states, int start, bool anchored_end) {
+	u8 classes[256];
+	int n_classes = make_byte_classes(states, n_states, classes);
+
+	int rep[256];
+	for (int b = 255; b >= 0; b--)
+		rep[classes[b]] = b;
+
+	u32 (*sets)[NFA_WORDS] = calloc(MAX_DFA_STATES, sizeof(*sets));
+	int *stack = malloc((2 * MAX_NFA_STATES + 1) * sizeof(int));
+
+	// The table is built a class at a time, and only spread out to every byte at the end
+	u16 *next_state = malloc(MAX_DFA_STATES * n_classes * sizeof(u16));
+	for (int c = 0; c < n_classes; c++) {
+		next_state[DFA_DEAD * n_classes + c] = DFA_DEAD;
+		next_state[DFA_ACCEPTED * n_classes + c] = DFA_ACCEPTED;
+	}
+
+	dfa.accepting = calloc(MAX_DFA_STATES, sizeof(bool));
+	dfa.accepting[DFA_ACCEPTED] = true;
+
+	int n = 2;
+	bool ok = true;
+
+	u32 seen[NFA_WORDS] = {0};
+	add_closure(states, start, sets[n], seen, stack);
+
+	int start_state = DFA_ACCEPTED;
+	if (anchored_end || !has_match(states, n_states, sets[n]))
+		start_state = n++;
+
+	for (int d = 2; d < n && ok; d++) {
+		dfa.accepting[d] = has_match(states, n_states, sets[d]);
+
+		for (int c = 0; c < n_classes && ok; c++) {
+			u32 target[NFA_WORDS] = {0};
+			memset(seen, 0, sizeof(seen));
+
+			bool empty = true;
+			for (int s = 0; s < n_states; s++) {
+				if ((sets[d][s >> 5] >> (s & 31)) & 1 && states[s].type == NFA_SET && has_byte(states[s].set, rep[c])) {
+					add_closure(states, states[s].out, target, seen, stack);
+					empty = false;
+				}
+			}
+
+			int next = DFA_DEAD;
+			if (!empty && !anchored_end && has_match(states, n_states, target))
+				next = DFA_ACCEPTED;
+			else if (!empty) {
+				for (next = 2; next < n && memcmp(sets[next], target, sizeof(target)); next++);
+
+				if (next == n) {
+					if (n == MAX_DFA_STATES)
+						ok = false;
+					else
+						memcpy(sets[n++], target, sizeof(target));
+				}
+			}
+
+			next_state[d * n_classes + c] = next;
+		}
+	}
+
+	if (ok) {
+		dfa.table = malloc(ROW(n) * sizeof(u32));
+		for (int d = 0; d < n; d++) {
+			for (int b = 0; b < 256; b++)
+				dfa.table[ROW(d) + b] = ROW(next_state[d * n_classes + classes[b]]);
+
+			if (d >= 2)
+				dfa.table[ROW(d)] = ROW(dfa.accepting[d] ? DFA_ACCEPTED : DFA_DEAD);
+		}
+	}
+
+	dfa.n_states = n;
+	dfa.start = ROW(start_state);
+
+	free(next_state);
+	free(sets);
+	free(stack);
+	return ok;
+}
+
+static bool compile_pattern(char *pattern, int len, int type) {
+	free(dfa.table);
+	free(dfa.accepting);
+	memset(&dfa, 0, sizeof(Dfa));
+
+	Parser p = {
+		.src = pattern,
+		.len = len,
+		.is_glob = type == PATTERN_GLOB,
+		.ignore_case = true,
+		.states = malloc(MAX_NFA_STATES * sizeof(Nfa_State))
+	};
+
+	// Smart case, as with every other kind of search. In a regular expression a letter after a backslash is a class
+	//  like \W rather than a letter to match, but in a glob it's the letter itself.
+	for (int i = 0; i < len; i++) {
+		if (pattern[i] == '\\' && !p.is_glob)
+			i++;
+		else if (isupper((u8)pattern[i]))
+			p.ignore_case = false;
+	}
+
+	// A regular expression is always anchored to the start of the name, and to the end only if it finishes with '$'
+	bool anchored_end = p.is_glob;
+	if (!p.is_glob) {
+		p.pos = 1;
+		if (len > 1 && pattern[len-1] == '$' && pattern[len-2] != '\\') {
+			anchored_end = true;
+			p.len--;
+		}
+	}
+
+	Fragment f = p.is_glob ? parse_sequence(&p) : parse_alternation(&p);
+	if (p.pos < p.len)
+		p.failed = true;
+
+	int match = add_state(&p, NFA_MATCH, -1, -1);
+	p.states[f.end].out = match;
+
+	dfa.valid = !p.failed && build_dfa(p.states, p.n_states, f.start, anchored_end);
+
+	memcpy(dfa.suffix, p.suffix, p.suffix_len);
+	dfa.suffix_len = p.suffix_len;
+	dfa.ignore_case = p.ignore_case;
+
+	free(p.states);
+	return dfa.valid;
+}
+
+static bool run_dfa(char *name) {
+	u32 s = dfa.start;
+	u8 *p = (u8*)name;
+	while (IS_RUNNING(s))
+		s = dfa.table[s + *p++];
+
+	return s == ROW(DFA_ACCEPTED);
+}
+
+// A term starting with '^' is a regular expression, and a term with an unescaped '*', '?' or '[' in it is a glob
+int get_pattern_type(char *term, int len) {
+	if (len > 0 && term[0] == '^')
+		return PATTERN_REGEX;
+
+	for (int i = 0; i < len; i++) {
+		if (term[i] == '\\')
+			i++;
+		else if (term[i] == '*' || term[i] == '?' || term[i] == '[')
+			return PATTERN_GLOB;
+	}
+
+	return PATTERN_NONE;
+}
+
+// Each chunk keeps up to max_results matches, in a part of the matches of its own
+static void match_chunk(void *arg, int chunk, int start, int end) {
+	Pattern_Task *task = (Pattern_Task*)arg;
+	Listing *listing = task->listing;
+	char *suffix_names = task->suffix_names;
+	int suffix_len = task->suffix_len;
+	int max_results = task->max_results;
+	int *matches = &task->matches[chunk * max_results];
+
+	// Nothing in the chunks after the results are filled can make it into them
+	int n = 0;
+	if (chunk <= __atomic_load_n(&task->filled_chunk, __ATOMIC_RELAXED)) {
+		for (int i = start; i < end && n < max_results; i++) {
+			int idx = listing->index[i];
+			int len = listing->lens[idx];
+			if (len < suffix_len || memcmp(&suffix_names[listing->offsets[idx] + len - suffix_len], dfa.suffix, suffix_len))
+				continue;
+
+			if (run_dfa(ENTRY_NAME(listing, idx)))
+				matches[n++] = idx;
+		}
+	}
+
+	__atomic_store_n(&task->counts[chunk], n, __ATOMIC_RELEASE);
+
+	// Chunks are taken in order, so the ones that are finished are mostly the ones at the start
+	int total = 0;
+	for (int c = 0; c < task->n_chunks; c++) {
+		int count = __atomic_load_n(&task->counts[c], __ATOMIC_ACQUIRE);
+		if (count < 0)
+			break;
+
+		total += count;
+		if (total >= max_results) {
+			int filled = __atomic_load_n(&task->filled_chunk, __ATOMIC_RELAXED);
+			while (c < filled && !__atomic_compare_exchange_n(&task->filled_chunk, &filled, c, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			break;
+		}
+	}
+}
+
+// Writes the first max_results entries that match the pattern into results, in the order of the listing's index,
+//  and returns how many were written. Nothing matches a pattern that's invalid or unfinished.
+int filter_by_pattern(Listing *listing, char *pattern, int len, int *results, int max_results) {
+	int type = get_pattern_type(pattern, len);
+	if (type == PATTERN_NONE || len > MAX_PATTERN)
+		return 0;
+
+	if (type != dfa_type || len != dfa_source_len || memcmp(pattern, dfa_source, len)) {
+		compile_pattern(pattern, len, type);
+		memcpy(dfa_source, pattern, len);
+		dfa_source_len = len;
+		dfa_type = type;
+	}
+
+	if (!dfa.valid)
+		return 0;
+
+	// The suffix is compared against the folded names when case is ignored, since it has no uppercase letters in it
+	char *suffix_names = dfa.ignore_case ? listing->folded : listing->names;
+	int suffix_len = suffix_names ? dfa.suffix_len : 0;
+
+	int n_chunks = (listing->n_entries + FILTER_CHUNK - 1) / FILTER_CHUNK;
+	int counts[n_chunks + 1];
+	for (int c = 0; c < n_chunks; c++)
+		counts[c] = -1;
+
+	// A listing small enough to be a single chunk is matched straight into the results
+	Pattern_Task task = {
+		.listing = listing,
+		.suffix_names = suffix_names,
+		.suffix_len = suffix_len,
+		.matches = n_chunks > 1 ? malloc(n_chunks * max_results * sizeof(int)) : results,
+		.counts = counts,
+		.n_chunks = n_chunks,
+		.max_results = max_results,
+		.filled_chunk = n_chunks
+	};
+	run_chunks(match_chunk, &task, listing->n_entries, FILTER_CHUNK);
+
+	if (n_chunks <= 1)
+		return n_chunks ? counts[0] : 0;
+
+	// The chunks' matches are taken in chunk order, which is the order of the listing's index
+	int n_matches = 0;
+	for (int c = 0; c < n_chunks && n_matches < max_results; c++) {
+		int n = counts[c] < max_results - n_matches ? counts[c] : max_results - n_matches;
+		memcpy(&results[n_matches], &task.matches[c * max_results], n * sizeof(int));
+		n_matches += n;
+	}
+
+	free(task.matches);
+	return n_matches;
+}
@@ -6,10 +6,14 @@
 #include <string.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <dirent.h>
 
 #define FONT_WIDTH(glyph) (int)(glyph.box_w + 0.5)
 #define FONT_HEIGHT(glyph) (int)(glyph.box_h + 0.5)
 
+#define ENTRY_NAME(list, idx) (&(list)->names[(list)->offsets[idx]])
+#define FOLDED_NAME(list, idx) (&(list)->folded[(list)->offsets[idx]])
+
 #define MIN_CHAR ' '
 #define MAX_CHAR '~'
 #define N_CHARS  (MAX_CHAR - MIN_CHAR + 1)
@@ -27,25 +31,75 @@
 #define STATUS_EXIT     0
 #define STATUS_COMMAND  1
 
+// How long the window waits on the filesystem before it treats a mount as slow and moves on
+#define IO_DEADLINE_MS  150
+
+#define DEFAULT_LISTING_MEMORY_MB  64
+
+// Big listings are filtered in chunks of this many entries, spread over the worker threads.
+// It's sized to keep each chunk's names and columns within a core's cache. The point where handing chunks to other
+//  threads starts to pay is an estimate from single-core timings, and hasn't been measured on a machine with several cores.
+#define FILTER_CHUNK  16384
+
+#define MOUNT_OK    0
+#define MOUNT_SLOW  1
+#define MOUNT_BUSY  2
+#define MOUNT_LOCAL 3
+
+#define SEARCH_PREFIX  0
+#define SEARCH_FUZZY   1
+
+#define PATTERN_NONE   0
+#define PATTERN_GLOB   1
+#define PATTERN_REGEX  2
+
 typedef unsigned char u8;
+typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 
 typedef struct {
+	char *base;
 	int pool_size;
 	int pool;
 	int idx;
-	bool allow_overflow;
+	char *chain;
+	u64 size;
 	bool initialized;
 } Arena;
 
 struct listing_struct {
-	char *name;
-	struct listing_struct *next;
-	char *first;
+	char *path;
+	u32 hash;
 	int *index;
-	char **table;
-	struct stat *stats;
+	int *sorted;
+	// Each entry is a column of these, with every name stored back to back in 'names'
+	char *names;
+	// The names with their ASCII letters in lowercase, at the same offsets, and the entries in the order of those names
+	char *folded;
+	int *folded_sorted;
+	u32 *offsets;
+	u16 *lens;
+	u8 *types;
 	int n_entries;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int watch;
+	bool from_cache;
+	Arena arena;
+	u32 id;
+	bool pending;
+	// Set while a pending listing holds the entries that have been read so far, sorted, but not the rest of them
+	bool partial;
+	// Everything from here on can change while the listing is in the table, and isn't given out with it
+	struct listing_struct *next;
+	u64 last_used;
+	bool stale;
+	bool late;
+	bool refreshing;
+	// Set if the listing was read by prefetching, before anyone asked for it
+	bool prefetched;
 };
 typedef struct listing_struct Listing;
 
@@ -79,6 +133,8 @@ typedef struct {
 	Program folder_program;
 	Program default_program;
 	Program *programs;
+	int search_mode;
+	int listing_memory;
 } Settings;
 
 typedef struct {
@@ -102,12 +158,38 @@ typedef struct {
 	float a, r, g, b;
 } ARGB;
 
+typedef struct {
+	char *path;
+	char *name;
+	char *exec;
+	struct timespec mtime;
+	bool terminal;
+	bool no_display;
+} Application;
+
+// applications.c
+void scan_applications(void);
+Application *get_applications(int *n);
+Application *get_loaded_applications(int *n);
+Application *find_application(char *name);
+
 // arena.c
 void make_arena(int pool_size, Arena *a);
 void find_next_pool(Arena *a);
 void *allocate(Arena *a, int size);
+void *reserve(Arena *a, int size);
+void free_arena(Arena *a);
 void defer_arena_destruction(void);
 
+// cache.c
+void open_listing_cache(void);
+bool find_cached_listing(char *path, struct stat *s, Listing *l);
+void write_listing_cache(Listing *list);
+
+// commands.c
+void list_commands(Listing *info);
+bool find_program(char *name, char **error_str);
+
 // config.c
 Settings *load_config(void);
 void save_config(char *path);
@@ -115,9 +197,21 @@ void save_config(char *path);
 // directory.c
 void init_directory_arena(void);
 bool list_directory(char *directory, int len, Listing *info);
+bool list_directory_within(char *directory, int len, Listing *info, int timeout_ms);
+int get_listing_notify_fd(void);
+void set_listing_budget(u64 bytes);
+void trim_listings(void);
 char *get_home_directory(void);
 char *get_desugared_path(char *str, int len);
-bool find_program(char *name, char **error_str);
+void scan_path_directories(void);
+int get_directory_watch(void);
+int get_listings_generation(void);
+void update_listings(void);
+void release_listings(void);
+void save_directory_cache(void);
+void prefetch_subdirectories(Listing *listing, int *entries, int n_entries);
+u32 new_listing_id(void);
+void fold_entries(Listing *l, Arena *a);
 
 // font.c
 int glyph_indexof(char c);
@@ -125,13 +219,53 @@ bool open_font(char *font_path);
 bool render_font(Screen_Info *info, Font_Attrs *attrs, u32 background, Glyph *chars);
 void close_font(void);
 
+// frecency.c
+void open_frecency(void);
+u64 frecency_key(u64 key, char *str, int len);
+u64 get_listing_key(Listing *listing);
+void record_launch(u64 key);
+int get_frecency(u64 listing_key, char *name);
+
+// fuzzy.c
+int fuzzy_search(Listing *listing, char *query, int query_len, int *results, int max_results);
+
 // gui.c
 bool open_display(int screen_idx, Screen_Info *screen_info);
 void close_display(void);
 int run_gui(Settings *config, Screen_Info *screen_info, Glyph *renders, char *textbox, int textbox_len, char *error_msg);
 
+// metadata.c
+void fetch_entry_types(int dir_fd, char *names, u32 *offsets, int *which, int n, u8 *types);
+
+// mounts.c
+int check_mount(char *path);
+void end_mount_read(char *path, bool on_time);
+void record_timeout(char *path);
+struct timespec get_deadline(int ms);
+bool stat_within(char *path, struct stat *s, int timeout_ms);
+
+// pattern.c
+int get_pattern_type(char *term, int len);
+int filter_by_pattern(Listing *listing, char *pattern, int len, int *results, int max_results);
+
+// pool.c
+void start_workers(void);
+void stop_workers(void);
+void submit_job(void (*func)(void*), void *arg);
+void submit_background_job(void (*func)(void*), void *arg);
+void cancel_background_jobs(void);
+void run_detached(void (*func)(void*), void *arg);
+void run_chunks(void (*func)(void*, int, int, int), void *arg, int n, int chunk_size);
+
+// search.c
+int get_search_notify_fd(void);
+void search_tree(char *path, char *str, int len, Listing *listing);
+void stop_search(void);
+
 // utils.c
 void make_argb(u32 color, ARGB *argb);
+void create_parent_directories(char *path);
+u32 hash_string(char *str, int len);
 void remove_char(char *str, int len, int pos);
 int insert_chars(char *str, int len, char *insert, int insert_len, int pos);
 int insert_substring(char *str, int len, char *insert, int insert_len, int pos);
@@ -139,7 +273,9 @@ int remove_backslashes(char *str, int span);
 int escape_spaces(char *str, int span);
 int find_next_word(char *str, int start, int end);
 void prepend_word(char *word, char *sentence);
-bool difference_ignoring_backslashes(char *str, char *word, int word_len, int trailing);
+int get_search_term(char *word, int word_len, int trailing, char *term);
+int get_pattern_term(char *word, int word_len, int trailing, char *term);
+int *find_prefix_range(Listing *listing, char *prefix, int prefix_len, int *lo, int *hi);
 bool enumerate_directory(char *textbox, int cursor, char **word, int *word_length, int *search_length, Listing *list);
 char *find_completeable_span(Listing *listing, char *word, int word_len, int trailing, int *match_length);
 int complete(char *word, int *word_length, char *match, int match_len, int trailing, bool folder_completion);
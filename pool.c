@@ -0,0 +1,328 @@
+// A fixed-size pool of worker threads, for work that shouldn't hold up the window
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define MIN_WORKERS 2
+#define MAX_WORKERS 8
+
+// How long to wait for running jobs when stopping, since a job stuck on a hung mount would otherwise never let the program exit
+#define STOP_DEADLINE_MS 500
+
+// Work split into chunks, which the workers and the thread that asked for it take one at a time
+typedef struct {
+	void (*func)(void*, int, int, int);
+	void *arg;
+	int n;
+	int chunk_size;
+	int n_chunks;
+	int next_chunk;
+	int n_done;
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} Chunked_Task;
+
+typedef struct job_struct {
+	void (*func)(void*);
+	void *arg;
+	struct job_struct *next;
+} Job;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static Job *queue = NULL;
+static Job **queue_tail = &queue;
+
+// Background jobs only run when there's nothing else to do
+static Job *background = NULL;
+static Job **background_tail = &background;
+static bool stopping = false;
+
+static pthread_t workers[MAX_WORKERS];
+static bool exited[MAX_WORKERS];
+static int n_workers = 0;
+
+// Chunked work only goes to as many workers as there are other cores to run them on
+static int n_helpers = 0;
+
+// The queue lock must be held before calling this
+static void drop_background_jobs() {
+	while (background) {
+		Job *job = background;
+		background = job->next;
+		free(job->arg);
+		free(job);
+	}
+	background_tail = &background;
+}
+
+static void *run_worker(void *arg) {
+	bool *has_exited = (bool*)arg;
+	pthread_mutex_lock(&queue_lock);
+
+	while (true) {
+		while (!queue && !background && !stopping)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+
+		if (stopping)
+			break;
+
+		Job *job;
+		if (queue) {
+			job = queue;
+			queue = job->next;
+			if (!queue)
+				queue_tail = &queue;
+		}
+		else {
+			job = background;
+			background = job->next;
+			if (!background)
+				background_tail = &background;
+		}
+
+		pthread_mutex_unlock(&queue_lock);
+
+		job->func(job->arg);
+		free(job);
+
+		// Nothing a job was given from the listings is needed by the next one
+		release_listings();
+
+		pthread_mutex_lock(&queue_lock);
+	}
+
+	*has_exited = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+static void *run_detached_job(void *arg) {
+	Job *job = (Job*)arg;
+	job->func(job->arg);
+	free(job);
+
+	release_listings();
+	return NULL;
+}
+
+void start_workers() {
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < MIN_WORKERS)
+		n = MIN_WORKERS;
+	if (n > MAX_WORKERS)
+		n = MAX_WORKERS;
+
+	// Workers still running at exit would be writing into arenas that are about to be freed
+	if (!stopping)
+		atexit(stop_workers);
+
+	int n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	stopping = false;
+	for (int i = 0; i < n; i++) {
+		exited[n_workers] = false;
+		if (pthread_create(&workers[n_workers], NULL, run_worker, &exited[n_workers]) == 0)
+			n_workers++;
+	}
+
+	n_helpers = n_cores - 1 < n_workers ? n_cores - 1 : n_workers;
+}
+
+static bool all_exited() {
+	for (int i = 0; i < n_workers; i++) {
+		if (!exited[i])
+			return false;
+	}
+	return true;
+}
+
+// Jobs that haven't started yet are dropped, while the ones already running are waited for, up to a point
+void stop_workers() {
+	pthread_mutex_lock(&queue_lock);
+
+	stopping = true;
+	while (queue) {
+		Job *job = queue;
+		queue = job->next;
+		free(job);
+	}
+	queue_tail = &queue;
+
+	drop_background_jobs();
+
+	pthread_cond_broadcast(&queue_cond);
+
+	struct timespec deadline = get_deadline(STOP_DEADLINE_MS);
+	while (!all_exited() && pthread_cond_timedwait(&queue_cond, &queue_lock, &deadline) != ETIMEDOUT);
+
+	// Workers that are still stuck are left to the kernel, which ends them when the program exits
+	for (int i = 0; i < n_workers; i++) {
+		if (exited[i])
+			pthread_join(workers[i], NULL);
+		else
+			pthread_detach(workers[i]);
+	}
+
+	n_workers = 0;
+	n_helpers = 0;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void submit_job(void (*func)(void*), void *arg) {
+	if (!n_workers) {
+		func(arg);
+		return;
+	}
+
+	Job *job = malloc(sizeof(Job));
+	*job = (Job) {
+		.func = func,
+		.arg = arg,
+		.next = NULL
+	};
+
+	pthread_mutex_lock(&queue_lock);
+
+	*queue_tail = job;
+	queue_tail = &job->next;
+
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// Background jobs own their argument, which is freed if the job is cancelled before it starts.
+// Without any workers, the job is dropped rather than holding up the caller.
+void submit_background_job(void (*func)(void*), void *arg) {
+	if (!n_workers) {
+		free(arg);
+		return;
+	}
+
+	Job *job = malloc(sizeof(Job));
+	*job = (Job) {
+		.func = func,
+		.arg = arg,
+		.next = NULL
+	};
+
+	pthread_mutex_lock(&queue_lock);
+
+	*background_tail = job;
+	background_tail = &job->next;
+
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// Drops every background job that hasn't started yet
+void cancel_background_jobs() {
+	pthread_mutex_lock(&queue_lock);
+	drop_background_jobs();
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// Runs the function on a thread of its own, for work that might never finish and so mustn't hold up a worker
+void run_detached(void (*func)(void*), void *arg) {
+	Job *job = malloc(sizeof(Job));
+	*job = (Job) {
+		.func = func,
+		.arg = arg,
+		.next = NULL
+	};
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, run_detached_job, job) != 0) {
+		free(job);
+		func(arg);
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static void release_task(Chunked_Task *task) {
+	pthread_mutex_lock(&task->lock);
+	bool last = --task->refs == 0;
+	pthread_mutex_unlock(&task->lock);
+
+	if (last) {
+		pthread_mutex_destroy(&task->lock);
+		pthread_cond_destroy(&task->done);
+		free(task);
+	}
+}
+
+// Takes chunks until there are none left
+static void run_task_chunks(Chunked_Task *task) {
+	while (true) {
+		int chunk = __atomic_fetch_add(&task->next_chunk, 1, __ATOMIC_RELAXED);
+		if (chunk >= task->n_chunks)
+			break;
+
+		int start = chunk * task->chunk_size;
+		int end = start + task->chunk_size < task->n ? start + task->chunk_size : task->n;
+		task->func(task->arg, chunk, start, end);
+
+		pthread_mutex_lock(&task->lock);
+		if (++task->n_done == task->n_chunks)
+			pthread_cond_broadcast(&task->done);
+		pthread_mutex_unlock(&task->lock);
+	}
+}
+
+// A worker may only get to the task once it's over, in which case there's nothing left for it to take
+static void help_with_task(void *arg) {
+	Chunked_Task *task = (Chunked_Task*)arg;
+	run_task_chunks(task);
+	release_task(task);
+}
+
+// Splits [0, n) into chunks of 'chunk_size' and runs func(arg, chunk, start, end) on each of them,
+//  spread over the workers and the calling thread, and returns once they're all done.
+// Each chunk writes its results somewhere of its own, so that merging them in chunk order gives the same results every time.
+// The caller takes chunks as well, so any that the workers are too busy to start are run by the caller instead.
+void run_chunks(void (*func)(void*, int, int, int), void *arg, int n, int chunk_size) {
+	int n_chunks = (n + chunk_size - 1) / chunk_size;
+	int helpers = n_chunks - 1 < n_helpers ? n_chunks - 1 : n_helpers;
+
+	if (helpers <= 0) {
+		for (int i = 0; i < n_chunks; i++)
+			func(arg, i, i * chunk_size, i == n_chunks - 1 ? n : (i + 1) * chunk_size);
+		return;
+	}
+
+	Chunked_Task *task = malloc(sizeof(Chunked_Task));
+	*task = (Chunked_Task) {
+		.func = func,
+		.arg = arg,
+		.n = n,
+		.chunk_size = chunk_size,
+		.n_chunks = n_chunks,
+		.refs = helpers + 1
+	};
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->done, NULL);
+
+	for (int i = 0; i < helpers; i++)
+		submit_job(help_with_task, task);
+
+	run_task_chunks(task);
+
+	// Whatever chunks are left were taken by workers, which only have to finish them
+	pthread_mutex_lock(&task->lock);
+	while (task->n_done < task->n_chunks)
+		pthread_cond_wait(&task->done, &task->lock);
+	pthread_mutex_unlock(&task->lock);
+
+	release_task(task);
+}
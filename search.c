@@ -0,0 +1,676 @@
+// Recursive search for files by name, for queries that start with "**".
+// The tree is walked by a team of threads that each keep a deque of directories still to be read.
+// A thread works through its own deque from the back, and once that runs dry, it steals from the front of someone else's,
+//  where the directories nearest the root (and so most likely to lead to more work) are kept.
+// Stopping a search never waits for its walkers, since one of them may be stuck on a hung mount.
+// They're told to stop and left to it, and the last one out frees what the search shared.
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pistachio.h"
+
+#define MAX_WALKERS      16
+#define MAX_RESULTS      100000
+#define MAX_IGNORE_FILE  64 * 1024
+#define DIRENT_BUF_SIZE  64 * 1024
+#define FLUSH_INTERVAL   64
+#define FLUSH_MS         20
+
+typedef struct {
+	u64 d_ino;
+	u64 d_off;
+	unsigned short d_reclen;
+	u8 d_type;
+	char d_name[];
+} Search_Dirent;
+
+// The patterns from one .gitignore file, which apply to everything below the directory it's in
+typedef struct ignore_struct {
+	struct ignore_struct *parent;
+	struct ignore_struct *next_alloc;
+	char *contents;
+	char **patterns;
+	u8 *flags;
+	int n_patterns;
+	int base_len;
+} Ignore;
+
+#define IGNORE_DIR_ONLY  1
+#define IGNORE_PATH      2
+
+typedef struct {
+	char *path;
+	int len;
+	Ignore *ignore;
+} Walk_Item;
+
+typedef struct {
+	pthread_mutex_t lock;
+	Walk_Item *items;
+	int head;
+	int tail;
+	int cap;
+} Deque;
+
+typedef struct {
+	Deque deque;
+	struct search_struct *search;
+	int id;
+} Walker;
+
+// Everything a search's walkers share, which is held by each of them and by the window until it stops the search
+typedef struct search_struct {
+	Walker walkers[MAX_WALKERS];
+	int n_walkers;
+	int refs;
+
+	// The length of the root's path as a prefix of every path below it, which for "/" is zero
+	int base_len;
+
+	// The term as it's matched, in lowercase unless the term contains an uppercase letter
+	char query[256];
+	int term_len;
+	bool ignore_case;
+
+	bool cancelled;
+
+	// Directories that have been queued or are being read. Once this reaches zero, the walk is over.
+	int n_pending;
+
+	// Walkers with nothing to do sleep until a directory is queued or the walk is over
+	pthread_mutex_t idle_lock;
+	pthread_cond_t work_ready;
+	int n_idle;
+
+	pthread_mutex_t results_lock;
+	char **results;
+	u32 *result_modes;
+	int n_results;
+	int results_cap;
+
+	Ignore *ignores;
+} Search;
+
+// Names that are never worth descending into
+static char *ignored_dirs[] = {
+	".git", "node_modules"
+};
+
+static Search *search = NULL;
+
+static char *root = NULL;
+
+static char term[256];
+static int term_len = 0;
+
+static bool searching = false;
+
+static int notify_fd = -1;
+
+// The copy of the results that the window draws from, which only the window's thread touches
+static char *view_names = NULL;
+static u32 *view_offsets = NULL;
+static u16 *view_lens = NULL;
+static u8 *view_types = NULL;
+static int *view_index = NULL;
+static int view_n = 0;
+static int view_cap = 0;
+static int view_names_size = 0;
+static int view_names_cap = 0;
+
+int get_search_notify_fd() {
+	if (notify_fd < 0)
+		notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	return notify_fd;
+}
+
+static void notify() {
+	u64 one = 1;
+	if (notify_fd >= 0)
+		write(notify_fd, &one, sizeof(u64));
+}
+
+static void push_item(Search *s, Deque *dq, Walk_Item *item) {
+	__atomic_add_fetch(&s->n_pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail >= dq->cap) {
+		// Make room by moving what's left to the start, and only grow if that isn't enough
+		int n = dq->tail - dq->head;
+		if (dq->head > 0 && n < dq->cap / 2)
+			memmove(dq->items, &dq->items[dq->head], n * sizeof(Walk_Item));
+		else {
+			dq->cap = dq->cap ? dq->cap * 2 : 256;
+			Walk_Item *items = malloc(dq->cap * sizeof(Walk_Item));
+			memcpy(items, &dq->items[dq->head], n * sizeof(Walk_Item));
+			free(dq->items);
+			dq->items = items;
+		}
+
+		dq->head = 0;
+		dq->tail = n;
+	}
+
+	dq->items[dq->tail++] = *item;
+	pthread_mutex_unlock(&dq->lock);
+
+	// The lock is only taken when someone is asleep, and a walker going to sleep looks for work once more with it held,
+	//  so either it sees this item or it's waiting by the time it's signalled
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->n_idle, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&s->idle_lock);
+		pthread_cond_signal(&s->work_ready);
+		pthread_mutex_unlock(&s->idle_lock);
+	}
+}
+
+// Wakes every walker that's asleep, once the walk is over or has been cancelled
+static void wake_walkers(Search *s) {
+	pthread_mutex_lock(&s->idle_lock);
+	pthread_cond_broadcast(&s->work_ready);
+	pthread_mutex_unlock(&s->idle_lock);
+}
+
+static bool has_work(Search *s) {
+	for (int i = 0; i < s->n_walkers; i++) {
+		Deque *dq = &s->walkers[i].deque;
+		pthread_mutex_lock(&dq->lock);
+		bool found = dq->tail > dq->head;
+		pthread_mutex_unlock(&dq->lock);
+
+		if (found)
+			return true;
+	}
+	return false;
+}
+
+// Sleeps until there might be a directory to take.
+// Returns false once the walk is over.
+static bool wait_for_work(Search *s) {
+	pthread_mutex_lock(&s->idle_lock);
+	__atomic_add_fetch(&s->n_idle, 1, __ATOMIC_SEQ_CST);
+
+	while (!__atomic_load_n(&s->cancelled, __ATOMIC_RELAXED) && __atomic_load_n(&s->n_pending, __ATOMIC_ACQUIRE) > 0 && !has_work(s))
+		pthread_cond_wait(&s->work_ready, &s->idle_lock);
+
+	__atomic_sub_fetch(&s->n_idle, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->idle_lock);
+
+	return !__atomic_load_n(&s->cancelled, __ATOMIC_RELAXED) && __atomic_load_n(&s->n_pending, __ATOMIC_ACQUIRE) > 0;
+}
+
+static bool pop_item(Deque *dq, Walk_Item *item) {
+	pthread_mutex_lock(&dq->lock);
+
+	bool found = dq->tail > dq->head;
+	if (found)
+		*item = dq->items[--dq->tail];
+
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static bool steal_item(Deque *dq, Walk_Item *item) {
+	if (pthread_mutex_trylock(&dq->lock) != 0)
+		return false;
+
+	bool found = dq->tail > dq->head;
+	if (found)
+		*item = dq->items[dq->head++];
+
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static Ignore *read_ignore_file(Search *s, int dir_fd, char *path, int path_len, Ignore *parent) {
+	int fd = openat(dir_fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return parent;
+
+	char *buf = malloc(MAX_IGNORE_FILE + 1);
+	int size = read(fd, buf, MAX_IGNORE_FILE);
+	close(fd);
+
+	if (size <= 0) {
+		free(buf);
+		return parent;
+	}
+	buf[size] = 0;
+
+	int n_lines = 1;
+	for (int i = 0; i < size; i++)
+		n_lines += buf[i] == '\n';
+
+	Ignore *ig = malloc(sizeof(Ignore));
+	*ig = (Ignore) {
+		.parent = parent,
+		.contents = buf,
+		.patterns = malloc(n_lines * sizeof(char*)),
+		.flags = malloc(n_lines),
+		.base_len = path_len
+	};
+
+	// Each pattern points into the file's contents, which is kept for as long as the patterns are
+	char *line = buf;
+	while (line) {
+		char *end = strchr(line, '\n');
+		if (end)
+			*end = 0;
+
+		int len = strlen(line);
+		while (len > 0 && (line[len-1] == ' ' || line[len-1] == '\r'))
+			line[--len] = 0;
+
+		// Negated patterns aren't supported, so they're skipped rather than being applied the wrong way around
+		if (len > 0 && line[0] != '#' && line[0] != '!') {
+			u8 flags = 0;
+			if (line[len-1] == '/') {
+				line[--len] = 0;
+				flags |= IGNORE_DIR_ONLY;
+			}
+			if (strchr(line, '/'))
+				flags |= IGNORE_PATH;
+			if (line[0] == '/')
+				line++;
+
+			if (*line) {
+				ig->patterns[ig->n_patterns] = line;
+				ig->flags[ig->n_patterns] = flags;
+				ig->n_patterns++;
+			}
+		}
+
+		line = end ? end + 1 : NULL;
+	}
+
+	if (!ig->n_patterns) {
+		free(ig->patterns);
+		free(ig->flags);
+		free(ig);
+		free(buf);
+		return parent;
+	}
+
+	pthread_mutex_lock(&s->results_lock);
+	ig->next_alloc = s->ignores;
+	s->ignores = ig;
+	pthread_mutex_unlock(&s->results_lock);
+
+	return ig;
+}
+
+static bool is_ignored(Ignore *ig, char *name, char *full_path, bool is_dir) {
+	for (int i = 0; i < sizeof(ignored_dirs) / sizeof(char*); i++) {
+		if (is_dir && !strcmp(name, ignored_dirs[i]))
+			return true;
+	}
+
+	for (; ig; ig = ig->parent) {
+		for (int i = 0; i < ig->n_patterns; i++) {
+			if ((ig->flags[i] & IGNORE_DIR_ONLY) && !is_dir)
+				continue;
+
+			// Patterns with a slash in them are matched against the path from the .gitignore's directory
+			if (ig->flags[i] & IGNORE_PATH) {
+				if (!fnmatch(ig->patterns[i], &full_path[ig->base_len + 1], FNM_PATHNAME))
+					return true;
+			}
+			else if (!fnmatch(ig->patterns[i], name, 0))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static bool matches_query(Search *s, char *name, int len) {
+	int term_len = s->term_len;
+	char *query = s->query;
+
+	for (int i = 0; i + term_len <= len; i++) {
+		int j = 0;
+		if (s->ignore_case)
+			while (j < term_len && tolower((u8)name[i+j]) == query[j]) j++;
+		else
+			while (j < term_len && name[i+j] == query[j]) j++;
+
+		if (j == term_len)
+			return true;
+	}
+	return false;
+}
+
+// Moves a walker's matches into the shared results, which the window copies from
+static void flush_results(Search *s, char **found, u32 *modes, int *n_found) {
+	if (!*n_found)
+		return;
+
+	pthread_mutex_lock(&s->results_lock);
+
+	int n = *n_found;
+	if (s->n_results + n > MAX_RESULTS) {
+		for (int i = MAX_RESULTS - s->n_results; i < n; i++)
+			free(found[i]);
+
+		n = MAX_RESULTS - s->n_results;
+		__atomic_store_n(&s->cancelled, true, __ATOMIC_RELAXED);
+		wake_walkers(s);
+	}
+
+	if (s->n_results + n > s->results_cap) {
+		s->results_cap = s->results_cap ? s->results_cap * 2 : 1024;
+		while (s->results_cap < s->n_results + n)
+			s->results_cap *= 2;
+
+		s->results = realloc(s->results, s->results_cap * sizeof(char*));
+		s->result_modes = realloc(s->result_modes, s->results_cap * sizeof(u32));
+	}
+
+	memcpy(&s->results[s->n_results], found, n * sizeof(char*));
+	memcpy(&s->result_modes[s->n_results], modes, n * sizeof(u32));
+	s->n_results += n;
+
+	pthread_mutex_unlock(&s->results_lock);
+
+	*n_found = 0;
+	notify();
+}
+
+static void walk_directory(Walker *self, Walk_Item *item, char *buf, char **found, u32 *modes, int *n_found) {
+	Search *s = self->search;
+
+	int fd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	Ignore *ignore = read_ignore_file(s, fd, item->path, item->len, item->ignore);
+
+	char path[4096];
+	memcpy(path, item->path, item->len);
+	path[item->len] = '/';
+
+	int size;
+	while (!__atomic_load_n(&s->cancelled, __ATOMIC_RELAXED) && (size = syscall(SYS_getdents64, fd, buf, DIRENT_BUF_SIZE)) > 0) {
+		for (int pos = 0; pos < size; ) {
+			Search_Dirent *ent = (Search_Dirent*)&buf[pos];
+			pos += ent->d_reclen;
+
+			char *name = ent->d_name;
+			if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+				continue;
+
+			int name_len = strlen(name);
+			int len = item->len + 1 + name_len;
+			if (len >= sizeof(path))
+				continue;
+
+			memcpy(&path[item->len + 1], name, name_len + 1);
+
+			u32 mode = DTTOIF(ent->d_type);
+			if (ent->d_type == DT_UNKNOWN) {
+				struct stat s;
+				mode = fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) == 0 ? s.st_mode : 0;
+			}
+
+			bool is_dir = (mode & S_IFMT) == S_IFDIR;
+			if (is_ignored(ignore, name, path, is_dir))
+				continue;
+
+			if (matches_query(s, name, name_len)) {
+				// Results are given relative to the root, since they replace the query in the search bar
+				found[*n_found] = strdup(&path[s->base_len + 1]);
+				modes[*n_found] = mode;
+				if (++*n_found == FLUSH_INTERVAL)
+					flush_results(s, found, modes, n_found);
+			}
+
+			if (is_dir) {
+				Walk_Item next = {
+					.path = malloc(len + 1),
+					.len = len,
+					.ignore = ignore
+				};
+				memcpy(next.path, path, len + 1);
+				push_item(s, &self->deque, &next);
+			}
+		}
+	}
+
+	close(fd);
+}
+
+static int get_time_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Frees the search once neither the window nor any of its walkers are holding it
+static void release_search(Search *s) {
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	for (int i = 0; i < s->n_walkers; i++) {
+		Deque *dq = &s->walkers[i].deque;
+		for (int j = dq->head; j < dq->tail; j++)
+			free(dq->items[j].path);
+
+		free(dq->items);
+		pthread_mutex_destroy(&dq->lock);
+	}
+
+	for (int i = 0; i < s->n_results; i++)
+		free(s->results[i]);
+
+	free(s->results);
+	free(s->result_modes);
+
+	while (s->ignores) {
+		Ignore *ig = s->ignores;
+		s->ignores = ig->next_alloc;
+		free(ig->contents);
+		free(ig->patterns);
+		free(ig->flags);
+		free(ig);
+	}
+
+	pthread_mutex_destroy(&s->idle_lock);
+	pthread_cond_destroy(&s->work_ready);
+	pthread_mutex_destroy(&s->results_lock);
+	free(s);
+}
+
+static void *run_walker(void *arg) {
+	Walker *self = (Walker*)arg;
+	Search *s = self->search;
+
+	char *buf = malloc(DIRENT_BUF_SIZE);
+	char *found[FLUSH_INTERVAL];
+	u32 modes[FLUSH_INTERVAL];
+	int n_found = 0;
+	int last_flush = get_time_ms();
+
+	while (!__atomic_load_n(&s->cancelled, __ATOMIC_RELAXED)) {
+		Walk_Item item;
+		bool got = pop_item(&self->deque, &item);
+
+		for (int i = 1; !got && i < s->n_walkers; i++)
+			got = steal_item(&s->walkers[(self->id + i) % s->n_walkers].deque, &item);
+
+		if (!got) {
+			// Whatever's been found is passed on before sleeping, since it could be a while before there's more
+			flush_results(s, found, modes, &n_found);
+			if (!wait_for_work(s))
+				break;
+
+			continue;
+		}
+
+		walk_directory(self, &item, buf, found, modes, &n_found);
+		free(item.path);
+
+		// Matches are passed on at least every so often, so that they show up while the walk is still going
+		int time = get_time_ms();
+		if (time - last_flush >= FLUSH_MS) {
+			flush_results(s, found, modes, &n_found);
+			last_flush = time;
+		}
+
+		if (__atomic_sub_fetch(&s->n_pending, 1, __ATOMIC_ACQ_REL) == 0)
+			wake_walkers(s);
+	}
+
+	flush_results(s, found, modes, &n_found);
+	free(buf);
+
+	// Wakes the window one last time, so that it sees the final results
+	notify();
+	release_search(s);
+	return NULL;
+}
+
+// Stops the current search, if there is one, and lets go of everything it found.
+// Its walkers are only told to stop, so this never waits on one that's stuck reading a directory.
+void stop_search() {
+	if (!searching)
+		return;
+
+	__atomic_store_n(&search->cancelled, true, __ATOMIC_RELAXED);
+	wake_walkers(search);
+	release_search(search);
+	search = NULL;
+
+	free(root);
+	root = NULL;
+	view_n = 0;
+	view_names_size = 0;
+	searching = false;
+}
+
+static void start_search(char *path, int path_len, char *str, int len) {
+	root = malloc(path_len + 1);
+	memcpy(root, path, path_len);
+	root[path_len] = 0;
+
+	memcpy(term, str, len);
+	term_len = len;
+
+	Search *s = calloc(1, sizeof(Search));
+	s->base_len = path_len == 1 && path[0] == '/' ? 0 : path_len;
+	s->term_len = len;
+
+	s->ignore_case = true;
+	for (int i = 0; i < len; i++) {
+		if (isupper((u8)str[i]))
+			s->ignore_case = false;
+	}
+
+	for (int i = 0; i < len; i++)
+		s->query[i] = s->ignore_case ? tolower((u8)str[i]) : str[i];
+
+	pthread_mutex_init(&s->idle_lock, NULL);
+	pthread_cond_init(&s->work_ready, NULL);
+	pthread_mutex_init(&s->results_lock, NULL);
+
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	s->n_walkers = n < 1 ? 1 : n > MAX_WALKERS ? MAX_WALKERS : n;
+
+	// Each walker holds the search, as does the window
+	s->refs = s->n_walkers + 1;
+
+	for (int i = 0; i < s->n_walkers; i++) {
+		s->walkers[i] = (Walker) { .search = s, .id = i };
+		pthread_mutex_init(&s->walkers[i].deque.lock, NULL);
+	}
+
+	Walk_Item first = {
+		.path = malloc(path_len + 1),
+		.len = s->base_len
+	};
+	memcpy(first.path, root, path_len + 1);
+	push_item(s, &s->walkers[0].deque, &first);
+
+	search = s;
+	searching = true;
+	get_search_notify_fd();
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (int i = 0; i < s->n_walkers; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, run_walker, &s->walkers[i]) != 0)
+			release_search(s);
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+// Searches every directory below 'path' for names containing 'str', and gives the matches found so far as a listing.
+// A search is only started again when the directory or the term changes, so calling this as results arrive just picks up the new ones.
+void search_tree(char *path, char *str, int len, Listing *listing) {
+	if (len > sizeof(term))
+		len = sizeof(term);
+
+	int path_len = strlen(path);
+	while (path_len > 1 && path[path_len-1] == '/')
+		path_len--;
+
+	bool same = searching &&
+		!strncmp(path, root, path_len) && root[path_len] == 0 &&
+		term_len == len && !memcmp(term, str, len);
+
+	if (!same) {
+		stop_search();
+		start_search(path, path_len, str, len);
+	}
+
+	Search *s = search;
+	pthread_mutex_lock(&s->results_lock);
+
+	if (s->n_results > view_cap) {
+		view_cap = s->n_results * 2;
+		view_offsets = realloc(view_offsets, view_cap * sizeof(u32));
+		view_lens = realloc(view_lens, view_cap * sizeof(u16));
+		view_types = realloc(view_types, view_cap * sizeof(u8));
+		view_index = realloc(view_index, view_cap * sizeof(int));
+	}
+
+	for (; view_n < s->n_results; view_n++) {
+		int len = strlen(s->results[view_n]);
+		if (view_names_size + len + 1 > view_names_cap) {
+			view_names_cap = (view_names_size + len + 1) * 2;
+			view_names = realloc(view_names, view_names_cap);
+		}
+
+		memcpy(&view_names[view_names_size], s->results[view_n], len + 1);
+		view_offsets[view_n] = view_names_size;
+		view_lens[view_n] = len;
+		view_types[view_n] = IFTODT(s->result_modes[view_n]);
+		view_index[view_n] = view_n;
+		view_names_size += len + 1;
+	}
+
+	pthread_mutex_unlock(&s->results_lock);
+
+	*listing = (Listing) {
+		.path = root,
+		.names = view_names,
+		.offsets = view_offsets,
+		.lens = view_lens,
+		.types = view_types,
+		.index = view_index,
+		.sorted = view_index,
+		.n_entries = view_n
+	};
+}
@@ -1,3 +1,5 @@
+#include <ctype.h>
+
 #include "pistachio.h"
 
 void make_argb(u32 color, ARGB *argb) {
@@ -7,6 +9,29 @@ void make_argb(u32 color, ARGB *argb) {
 	argb->b = (float)(0xff & color);
 }
 
+void create_parent_directories(char *path) {
+	int len = strlen(path);
+	char dir[len + 1];
+
+	for (int i = 1; i < len; i++) {
+		if (path[i] != '/')
+			continue;
+
+		memcpy(dir, path, i);
+		dir[i] = 0;
+		mkdir(dir, 0777);
+	}
+}
+
+// FNV-1a
+u32 hash_string(char *str, int len) {
+	u32 hash = 2166136261u;
+	for (int i = 0; len < 0 ? str[i] : i < len; i++)
+		hash = (hash ^ (u8)str[i]) * 16777619u;
+
+	return hash;
+}
+
 void remove_char(char *str, int len, int pos) {
 	if (pos > 0 && pos <= len) {
 		memmove(&str[pos-1], &str[pos], len - pos);
@@ -143,22 +168,71 @@ void prepend_word(char *word, char *sentence) {
 	sentence[insert_len-1] = ' ';
 }
 
-bool difference_ignoring_backslashes(char *name, char *word, int word_len, int trailing) {
-	if (!trailing)
+// Copies the part of the word being searched for without any backslashes
+int get_search_term(char *word, int word_len, int trailing, char *term) {
+	int len = 0;
+	for (int i = word_len - trailing; i < word_len; i++) {
+		if (word[i] != '\\')
+			term[len++] = word[i];
+	}
+
+	term[len] = 0;
+	return len;
+}
+
+// Whether a search should ignore case, which it does unless the term contains an uppercase letter
+static bool is_smart_case(Listing *listing, char *term, int term_len) {
+	if (!listing->folded)
 		return false;
 
-	char *search = &word[word_len - trailing];
-	for (int i = 0; i < trailing && search[i]; i++) {
-		if (name[i] == '\\')
-			name++;
-		if (search[i] == '\\')
-			search++;
+	for (int i = 0; i < term_len; i++) {
+		if (isupper((u8)term[i]))
+			return false;
+	}
+	return true;
+}
+
+// Copies the part of the word being searched for as a pattern, where only the backslashes in front of spaces are removed,
+//  since the rest are part of the pattern
+int get_pattern_term(char *word, int word_len, int trailing, char *term) {
+	int len = 0;
+	for (int i = word_len - trailing; i < word_len; i++) {
+		if (word[i] != '\\' || i + 1 >= word_len || word[i+1] != ' ')
+			term[len++] = word[i];
+	}
+
+	term[len] = 0;
+	return len;
+}
 
-		if (name[i] != search[i])
-			return true;
+// Finds the range of entries that start with the given prefix, and returns the name-sorted view that the range is in.
+// Case is ignored unless the prefix contains an uppercase letter, in which case the view is sorted by the folded names.
+int *find_prefix_range(Listing *listing, char *prefix, int prefix_len, int *lo, int *hi) {
+	bool ignore_case = is_smart_case(listing, prefix, prefix_len);
+	char *names = ignore_case ? listing->folded : listing->names;
+	int *view = ignore_case ? listing->folded_sorted : listing->sorted;
+
+	int start = 0, end = listing->n_entries;
+	while (start < end) {
+		int mid = start + (end - start) / 2;
+		if (strncmp(&names[listing->offsets[view[mid]]], prefix, prefix_len) < 0)
+			start = mid + 1;
+		else
+			end = mid;
 	}
+	*lo = start;
+
+	end = listing->n_entries;
+	while (start < end) {
+		int mid = start + (end - start) / 2;
+		if (strncmp(&names[listing->offsets[view[mid]]], prefix, prefix_len) == 0)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	*hi = start;
 
-	return false;
+	return view;
 }
 
 bool enumerate_directory(char *textbox, int cursor, char **word, int *word_length, int *search_length, Listing *list) {
@@ -189,12 +263,13 @@ bool enumerate_directory(char *textbox, int cursor, char **word, int *word_lengt
 
 		remove_backslashes(directory, -1);
 	}
-	else {
-		strcpy(directory, BINARIES_DIR);
+	else
 		search_len = word_len;
-	}
 
-	list_directory(directory, -1, list);
+	if (is_command)
+		list_commands(list);
+	else
+		list_directory_within(directory, -1, list, IO_DEADLINE_MS);
 	if (word)
 		*word = &textbox[first];
 	if (word_length)
@@ -209,26 +284,53 @@ char *find_completeable_span(Listing *listing, char *word, int word_len, int tra
 	char *match = NULL;
 	int match_len = 0;
 
-	if (trailing) {
-		for (int i = 0; i < listing->n_entries; i++) {
-			char *str = listing->table[i];
-			if (difference_ignoring_backslashes(str, word, word_len, trailing))
-				continue;
+	char pattern[trailing + 1];
+	int pattern_len = get_pattern_term(word, word_len, trailing, pattern);
+
+	// A pattern is only completed once it's narrowed the listing down to one entry
+	if (trailing && get_pattern_type(pattern, pattern_len) != PATTERN_NONE) {
+		int found[2];
+		if (filter_by_pattern(listing, pattern, pattern_len, found, 2) == 1) {
+			match = ENTRY_NAME(listing, found[0]);
+			match_len = listing->lens[found[0]];
+		}
+	}
+	else if (trailing) {
+		char term[trailing + 1];
+		int term_len = get_search_term(word, word_len, trailing, term);
+
+		int lo, hi;
+		int *view = find_prefix_range(listing, term, term_len, &lo, &hi);
+
+		// In a sorted range, the prefix shared by the first and last entries is shared by all of them
+		if (lo < hi && view == listing->sorted) {
+			match = ENTRY_NAME(listing, view[lo]);
+			char *last = ENTRY_NAME(listing, view[hi-1]);
 
-			if (!match) {
-				match = str;
-				match_len = strlen(match);
-				continue;
+			for (match_len = term_len; match[match_len] && last[match_len] == match[match_len]; match_len++);
+		}
+		// When case is ignored, the entries can only be completed as far as they also agree on case
+		else if (lo < hi) {
+			match = ENTRY_NAME(listing, view[lo]);
+			match_len = listing->lens[view[lo]];
+
+			for (int i = lo + 1; i < hi && match_len > 0; i++) {
+				char *name = ENTRY_NAME(listing, view[i]);
+				int len = 0;
+				while (len < match_len && name[len] == match[len])
+					len++;
+				match_len = len;
 			}
 
-			int j;
-			for (j = trailing; j < match_len && str[j] == match[j]; j++);
-			match_len = j;
+			if (match_len < term_len) {
+				match = NULL;
+				match_len = 0;
+			}
 		}
 	}
 	else if (listing->n_entries == 1) {
-		match = listing->first;
-		match_len = strlen(match);
+		match = ENTRY_NAME(listing, 0);
+		match_len = listing->lens[0];
 	}
 
 	if (match_length)
@@ -259,7 +361,7 @@ int complete(char *word, int *word_length, char *match, int match_len, int trail
 	char *path = get_desugared_path(word, word_len);
 
 	// If folder completion is enabled and 'word' refers to a folder, append a forward slash for further tab completion
-	if (folder_completion && stat(path, &s) == 0 && (s.st_mode & S_IFMT) == S_IFDIR) {
+	if (folder_completion && stat_within(path, &s, IO_DEADLINE_MS) && (s.st_mode & S_IFMT) == S_IFDIR) {
 		trailing = 0;
 		if (word[word_len-1] != '/')
 			word_len += insert_substring(word, -1, "/", 1, word_len);